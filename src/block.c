@@ -112,8 +112,8 @@ cs_bool Block_BulkUpdateAdd(BulkBlockUpdate *bbu, cs_uint32 offset, BlockID id)
 			Block_BulkUpdateClean(bbu);
 		} else return false;
 	}
-	((cs_uint32 *)bbu->data.offsets)[bbu->data.count++] = htonl(offset);
-	bbu->data.ids[bbu->data.count] = id;
+	((cs_uint32 *)bbu->data.offsets)[bbu->data.count] = htonl(offset);
+	bbu->data.ids[bbu->data.count++] = id;
 	return true;
 }
 
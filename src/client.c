@@ -10,11 +10,32 @@
 #include "event.h"
 #include "heartbeat.h"
 #include "lang.h"
-#include <zlib.h>
+#include "reactor.h"
 
 AListField *headAssocType = NULL,
 *headCGroup = NULL;
 
+#define QUEUE_FLUSH_THRESHOLD 16384
+#define QUEUE_WAIT_TIMEOUT 5000
+#define QUEUE_DEFLATE_MAX 16384 // Сколько байт очереди сжимается в одно сообщение
+
+static cs_uint32 QueueSize = 0;
+static cs_bool QueueKick = false;
+static cs_int32 ViewRadius = 0;
+static cs_int32 MaxTransfers = 4;
+static cs_int32 volatile TransferTicket = 0;
+static cs_int64 MapSendRate = 0, MapTokens = 0;
+static cs_byte WsDeflateBits = 0;
+static Mutex *ListMutex = NULL; // Подключения принимают сразу несколько реакторов
+static Mutex *ReapMutex = NULL;
+static Waitable *ReapWait = NULL; // Сигналит, когда в очереди появился клиент или поток пора остановить
+static Thread ReaperThreadHandle = NULL;
+static cs_bool volatile ReaperActive = false;
+static Client *ReapQueue[MAX_CLIENTS] = {0};
+static cs_int32 ReapHead = 0, ReapCount = 0;
+
+THREAD_FUNC(ReaperThread);
+
 static AListField *AGetType(cs_uint16 type) {
 	AListField *ptr = NULL;
 
@@ -156,8 +177,11 @@ Client *Client_New(Socket fd, cs_uint32 addr) {
 	tmp->addr = addr;
 	tmp->id = CLIENT_SELF;
 	tmp->mutex = Mutex_Create();
-	tmp->rdbuf = Memory_Alloc(134, 1);
+	tmp->rdbuf = Memory_Alloc(CLIENT_RDBUF_SIZE, 1);
 	tmp->wrbuf = Memory_Alloc(2048, 1);
+	tmp->queue.size = QueueSize;
+	tmp->queue.data = Memory_Alloc(QueueSize, 1);
+	tmp->queue.entries = Memory_Alloc(CQUEUE_ENTRIES, sizeof(CQueueEntry));
 	return tmp;
 }
 
@@ -260,112 +284,158 @@ cs_bool Client_Despawn(Client *client) {
 	PlayerData *pd = client->playerData;
 	if(!pd || !pd->spawned) return false;
 	pd->spawned = false;
-	Client *other;
-	for(cs_uint32 i = 0; (other = Clients_List[i]) != NULL; i++)
+	Memory_Zero(pd->visible, CLIENTMASK_SIZE);
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *other = Clients_List[i];
+		if(!other) continue;
+		if(other->playerData && client->id >= 0)
+			ClientMask_Clear(other->playerData->visible, client->id);
 		Vanilla_WriteDespawn(other, client);
+	}
 	Event_Call(EVT_ONDESPAWN, client);
 	return true;
 }
 
-#define CHUNK_SIZE 1024
-
 THREAD_FUNC(WorldSendThread) {
 	Client *client = (Client *)param;
 	if(client->closed) return 0;
 	PlayerData *pd = client->playerData;
 	World *world = pd->world;
 
-	if(world->process == WP_LOADING)
-		Waitable_Wait(world->wait);
-
-	if(!world->loaded) {
+	if(!World_EnsureLoaded(world, true)) {
 		Client_Kick(client, Lang_Get(Lang_KickGrp, 6));
 		return 0;
 	}
 
-	Vanilla_WriteLvlInit(client, World_GetBlockArraySize(world));
-	Mutex_Lock(client->mutex);
-	cs_byte *data = (cs_byte *)client->wrbuf;
-
-	*data++ = 0x03;
-	cs_uint16 *len = (cs_uint16 *)data++;
-	Bytef *out = ++data;
-
-	cs_int32 ret, wndBits;
-	z_stream stream = {0};
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
-
-	if(Client_GetExtVer(client, EXT_FASTMAP)) {
-		stream.next_in = World_GetBlockArray(world, &stream.avail_in);
-		wndBits = -15;
-	} else {
-		stream.next_in = World_GetData(world, &stream.avail_in);
-		wndBits = 31;
-	}
-
-	if((ret = deflateInit2(
-		&stream,
-		Z_DEFAULT_COMPRESSION,
-		Z_DEFLATED,
-		wndBits,
-		8,
-		Z_DEFAULT_STRATEGY)) != Z_OK) {
-			Log_Error("deflateInit2 error: %s", zError(ret));
+	/*
+	** Сжатая карта собирается один раз и
+	** затем раздаётся всем заходящим в мир
+	** клиентам, пока в нём не поменяется
+	** хотя бы один блок. Дальше клиент ждёт
+	** своей очереди в Clients_UpdateTransfers,
+	** а сами куски карты доложит Client_Tick.
+	** WebSocket клиентам каждый пакет нужно
+	** обернуть во фрейм, поэтому файл мира
+	** напрямую им не отдать.
+	*/
+	cs_int32 type = Client_GetExtVer(client, EXT_FASTMAP) ? WC_FASTMAP : WC_GZIP;
+	cs_uint32 offset = 0, chunks = 0;
+	WorldCache *cache = NULL;
+	cs_file file = client->websock ? NULL : World_OpenStream(world, type, &offset, &chunks);
+	if(!file && !(cache = World_GetCache(world, type))) {
 		pd->state = STATE_WLOADERR;
+		Client_Kick(client, Lang_Get(Lang_KickGrp, 6));
 		return 0;
 	}
 
-	cs_byte zstate = 0;
-	do {
-		stream.next_out = out;
-		stream.avail_out = CHUNK_SIZE;
+	/*
+	** Игрок, уже стоящий в этом мире, получает
+	** карту заново без очереди: иначе одна большая
+	** правка мира раскидала бы всех по очереди.
+	*/
+	cs_bool reload = client->mapstream.reload;
+	if(reload) Vanilla_WriteLvlInit(client, World_GetBlockArraySize(world));
 
-		if((ret = deflate(&stream, zstate == 0 ? Z_NO_FLUSH : Z_FINISH)) == Z_STREAM_ERROR) {
-			pd->state = STATE_WLOADERR;
-			goto world_send_end;
+	Mutex_Lock(client->mutex);
+	client->mapstream.cache = cache;
+	client->mapstream.chunk = 0;
+	client->mapstream.file = file;
+	client->mapstream.start = client->mapstream.offset = offset;
+	client->mapstream.end = offset + chunks * WORLD_CHUNK_PACKET;
+	client->mapstream.ticket = Atomic_Inc(&TransferTicket);
+	client->mapstream.position = 0;
+	client->mapstream.admitted = reload;
+	Mutex_Unlock(client->mutex);
+	return 0;
+}
+
+/*
+** Одновременно карта отправляется не более чем
+** MaxTransfers клиентам, остальные ждут в порядке
+** получения билета. Пока клиент ждёт, он остаётся
+** в старом мире (или на экране подключения) и
+** видит свою позицию в очереди. Общий объём данных
+** карт, уходящих за секунду, ограничен MapSendRate.
+*/
+void Clients_UpdateTransfers(cs_int32 delta) {
+	// Без запаса больше чем на четверть секунды, чтобы не было всплесков
+	if(MapSendRate > 0)
+		MapTokens = min(MapTokens + MapSendRate * delta / 1000, max(MapSendRate / 4, WORLD_CHUNK_PACKET));
+
+	Client *waiting[MAX_CLIENTS];
+	cs_int32 active = 0, count = 0;
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(!client || client->closed) continue;
+		Mutex_Lock(client->mutex);
+		CMapStream *ms = &client->mapstream;
+		if(MapStream_IsActive(ms)) {
+			if(ms->admitted) active++;
+			else waiting[count++] = client;
+		}
+		Mutex_Unlock(client->mutex);
+	}
+	if(count == 0) return;
+
+	for(cs_int32 i = 1; i < count; i++) {
+		Client *client = waiting[i];
+		cs_int32 j = i;
+		for(; j > 0 && waiting[j - 1]->mapstream.ticket > client->mapstream.ticket; j--)
+			waiting[j] = waiting[j - 1];
+		waiting[j] = client;
+	}
+
+	cs_int32 admitted = 0;
+	for(cs_int32 i = 0; i < count; i++) {
+		Client *client = waiting[i];
+		CMapStream *ms = &client->mapstream;
+
+		if(active < MaxTransfers) {
+			active++;
+			admitted++;
+			if(ms->position > 0 && Client_GetExtVer(client, EXT_MESSAGETYPE))
+				Client_Chat(client, MT_STATUS1, "");
+			Vanilla_WriteLvlInit(client, World_GetBlockArraySize(Client_GetWorld(client)));
+			Mutex_Lock(client->mutex);
+			ms->admitted = true;
+			Mutex_Unlock(client->mutex);
+			continue;
 		}
 
-		if(stream.avail_out == CHUNK_SIZE) {
-			if(zstate == 1)
-				zstate = 2;
-			else
-				zstate = 1;
-		} else {
-			*len = htons(CHUNK_SIZE - (cs_uint16)stream.avail_out);
-			if(client->closed || !Client_Send(client, CHUNK_SIZE + 4)) {
-				pd->state = STATE_WLOADERR;
-				goto world_send_end;
+		cs_int32 position = i - admitted + 1;
+		if(ms->position != position) {
+			ms->position = position;
+			if(Client_GetExtVer(client, EXT_MESSAGETYPE)) {
+				cs_char message[65];
+				String_FormatBuf(message, 65, Lang_Get(Lang_MsgGrp, 0), position);
+				Client_Chat(client, MT_STATUS1, message);
 			}
 		}
-	} while(zstate != 2);
-	pd->state = STATE_WLOADDONE;
+	}
+}
 
-	world_send_end:
-	deflateEnd(&stream);
-	Mutex_Unlock(client->mutex);
-	if(pd->state == STATE_WLOADDONE) {
-		pd->state = STATE_INGAME;
+static void FinishMapStream(Client *client) {
+	PlayerData *pd = client->playerData;
+	World *world = pd->world;
+
+	pd->state = STATE_INGAME;
+	// При перезагрузке карты игрок остаётся там, где стоял
+	if(!client->mapstream.reload) {
 		pd->position = world->info.spawnVec;
 		pd->angle = world->info.spawnAng;
-		Event_Call(EVT_PRELVLFIN, client);
-		if(Client_GetExtVer(client, EXT_BLOCKDEF)) {
-			for(BlockID id = 0; id < 255; id++) {
-				BlockDef *bdef = Block_GetDefinition(id);
-				if(bdef) Client_DefineBlock(client, bdef);
-			}
+	}
+	Event_Call(EVT_PRELVLFIN, client);
+	if(Client_GetExtVer(client, EXT_BLOCKDEF)) {
+		for(BlockID id = 0; id < 255; id++) {
+			BlockDef *bdef = Block_GetDefinition(id);
+			if(bdef) Client_DefineBlock(client, bdef);
 		}
-		Vanilla_WriteLvlFin(client, &world->info.dimensions);
-		Client_Spawn(client);
-	} else
-		Client_Kick(client, Lang_Get(Lang_KickGrp, 6));
-
-	return 0;
+	}
+	Vanilla_WriteLvlFin(client, &world->info.dimensions);
+	Client_Spawn(client);
 }
 
-cs_bool Client_ChangeWorld(Client *client, World *world) {
-	if(Client_IsInWorld(client, world)) return false;
+static cs_bool SendWorld(Client *client, World *world, cs_bool reload) {
 	PlayerData *pd = client->playerData;
 
 	if(pd->state != STATE_INITIAL && pd->state != STATE_INGAME) {
@@ -376,11 +446,24 @@ cs_bool Client_ChangeWorld(Client *client, World *world) {
 	Client_Despawn(client);
 	pd->world = world;
 	pd->state = STATE_MOTD;
-	if(!world->loaded) World_Load(world);
-	client->thread[1] = Thread_Create(WorldSendThread, client, false);
+	World_EnsureLoaded(world, false);
+	if(client->thread) Thread_Join(client->thread);
+	client->mapstream.reload = reload;
+	client->thread = Thread_Create(WorldSendThread, client, false);
 	return true;
 }
 
+cs_bool Client_ChangeWorld(Client *client, World *world) {
+	if(Client_IsInWorld(client, world)) return false;
+	return SendWorld(client, world, false);
+}
+
+cs_bool Client_ReloadWorld(Client *client) {
+	World *world = Client_GetWorld(client);
+	if(!world) return false;
+	return SendWorld(client, world, client->playerData->state == STATE_INGAME);
+}
+
 void Client_UpdateWorldInfo(Client *client, World *world, cs_bool updateAll) {
 	/*
 	** Нет смысла пыжиться в попытках
@@ -464,8 +547,62 @@ static cs_uint32 copyMessagePart(cs_str msg, cs_char *part, cs_uint32 i, cs_char
 	return len;
 }
 
+static cs_int32 GetHudSlot(cs_byte type) {
+	if(type >= MT_STATUS1 && type <= MT_STATUS3)
+		return type - MT_STATUS1;
+	if(type >= MT_BRIGHT1 && type <= MT_BRIGHT3)
+		return 3 + type - MT_BRIGHT1;
+	if(type == MT_ANNOUNCE)
+		return 6;
+	return -1;
+}
+
+static void FlushHud(Client *client) {
+	CRate *rate = &client->rate;
+	cs_char hud[RATE_HUD_SLOTS][65];
+	cs_byte mask;
+
+	Mutex_Lock(client->mutex);
+	mask = rate->hudmask;
+	rate->hudmask = 0;
+	Memory_Copy(hud, rate->hud, sizeof(hud));
+	Mutex_Unlock(client->mutex);
+
+	for(cs_int32 i = 0; i < RATE_HUD_SLOTS; i++) {
+		if(mask & BIT(i)) {
+			cs_byte type = i < 3 ? MT_STATUS1 + i : (i < 6 ? MT_BRIGHT1 + i - 3 : MT_ANNOUNCE);
+			Vanilla_WriteChat(client, type, hud[i]);
+		}
+	}
+}
+
 void Client_Chat(Client *client, cs_byte type, cs_str message) {
 	cs_uint32 msgLen = (cs_uint32)String_Length(message);
+	cs_int32 slot = GetHudSlot(type);
+
+	/*
+	** HUD-сообщения игроку с отстающим соединением
+	** откладываются до разрешённого регулятором тика,
+	** причём из нескольких сообщений в один слот
+	** будет отправлено только последнее.
+	*/
+	if(slot != -1) {
+		if(client == Broadcast) {
+			for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+				Client *other = Clients_List[i];
+				if(other) Client_Chat(other, type, message);
+			}
+			return;
+		}
+
+		if(client->rate.interval > 0) {
+			Mutex_Lock(client->mutex);
+			String_Copy(client->rate.hud[slot], 65, message);
+			client->rate.hudmask |= BIT(slot);
+			Mutex_Unlock(client->mutex);
+			return;
+		}
+	}
 
 	if(msgLen > 62 && type == MT_CHAT) {
 		cs_char color = 0, part[65] = {0};
@@ -504,6 +641,7 @@ static void HandlePacket(Client *client, cs_char *data, Packet *packet, cs_bool
 
 static cs_uint16 GetPacketSizeFor(Packet *packet, Client *client, cs_bool *extended) {
 	cs_uint16 packetSize = packet->size;
+	*extended = false;
 	if(packet->haveCPEImp) {
 		*extended = Client_GetExtVer(client, packet->exthash) == packet->extVersion;
 		if(*extended) packetSize = packet->extSize;
@@ -512,9 +650,40 @@ static cs_uint16 GetPacketSizeFor(Packet *packet, Client *client, cs_bool *exten
 }
 
 void Client_Init(void) {
+	QueueSize = Config_GetInt32ByKey(Server_Config, CFG_QUEUESIZE_KEY) * 1024;
+	QueueKick = String_CaselessCompare(Config_GetStrByKey(Server_Config, CFG_QUEUEPOLICY_KEY), "kick");
+	ViewRadius = Config_GetInt16ByKey(Server_Config, CFG_VIEWRADIUS_KEY);
+	MaxTransfers = Config_GetInt8ByKey(Server_Config, CFG_MAXTRANSFERS_KEY);
+	MapSendRate = (cs_int64)Config_GetInt32ByKey(Server_Config, CFG_MAPRATE_KEY) * 1024;
+	WsDeflateBits = (cs_byte)Config_GetInt8ByKey(Server_Config, CFG_WSDEFLATE_KEY);
+	// zlib не сжимает с окном меньше 512 байт
+	if(WsDeflateBits > 0 && WsDeflateBits < 9) WsDeflateBits = 9;
 	Broadcast = Memory_Alloc(1, sizeof(Client));
 	Broadcast->wrbuf = Memory_Alloc(2048, 1);
 	Broadcast->mutex = Mutex_Create();
+	ListMutex = Mutex_Create();
+	ReapMutex = Mutex_Create();
+	ReapWait = Waitable_Create();
+	ReaperActive = true;
+	ReaperThreadHandle = Thread_Create(ReaperThread, NULL, false);
+}
+
+/*
+** Дожидается, пока фоновый поток разберёт очередь
+** и завершится, после чего освобождает клиентов,
+** которых он успел отпустить: тикать их уже некому.
+*/
+void Client_Uninit(void) {
+	if(!ReaperActive) return;
+	ReaperActive = false;
+	Waitable_Signal(ReapWait);
+	if(Thread_IsValid(ReaperThreadHandle))
+		Thread_Join(ReaperThreadHandle);
+
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(client && client->reaping) Client_Free(client);
+	}
 }
 
 cs_bool Client_IsInGame(Client *client) {
@@ -526,10 +695,19 @@ cs_bool Client_IsInSameWorld(Client *client, Client *other) {
 	return Client_GetWorld(client) == Client_GetWorld(other);
 }
 
+cs_bool Client_IsVisible(Client *client, Client *other) {
+	if(ViewRadius == 0) return Client_IsInSameWorld(client, other);
+	return client == other || ClientMask_Test(client->playerData->visible, other->id);
+}
+
 cs_bool Client_IsInWorld(Client *client, World *world) {
 	return Client_GetWorld(client) == world;
 }
 
+cs_uint32 Client_GetUpdateInterval(Client *client) {
+	return client->rate.interval;
+}
+
 cs_bool Client_IsOP(Client *client) {
 	PlayerData *pd = client->playerData;
 	return pd ? pd->isOP : false;
@@ -667,7 +845,9 @@ cs_bool Client_RegisterParticle(Client *client, CustomParticle *e) {
 
 cs_bool Client_SpawnParticle(Client *client, cs_byte id, Vec *pos, Vec *origin) {
 	if(Client_GetExtVer(client, EXT_PARTICLE)) {
-		CPE_WriteSpawnEffect(client, id, pos, origin);
+		// Клиенту с отстающим соединением лишние частицы ни к чему
+		if(client->rate.due)
+			CPE_WriteSpawnEffect(client, id, pos, origin);
 		return true;
 	}
 	return false;
@@ -752,9 +932,19 @@ cs_bool Client_Update(Client *client) {
 	if(updates == PCU_NONE) return false;
 	cpd->updates = PCU_NONE;
 
+	/*
+	** Самому клиенту пакеты собираются отдельно,
+	** так как вместо его id в них пишется CLIENT_SELF.
+	** Для всех остальных пакет собирается лишь раз.
+	*/
+	PacketBuf *name = NULL, *model = NULL, *ent[2] = {NULL, NULL},
+	*prop[3] = {NULL, NULL, NULL};
+
 	for(ClientID id = 0; id < MAX_CLIENTS; id++) {
 		Client *other = Clients_List[id];
-		if(other) {
+		if(!other) continue;
+
+		if(other == client) {
 			if(updates & PCU_GROUP)
 				CPE_WriteAddName(other, client);
 			if(updates & PCU_MODEL)
@@ -765,23 +955,365 @@ cs_bool Client_Update(Client *client) {
 				for(cs_int8 i = 0; i < 3; i++) {
 					CPE_WriteSetEntityProperty(other, client, i, cpd->rotation[i]);
 				}
+			continue;
 		}
+
+		if(updates & PCU_GROUP) {
+			if(!name) name = CPE_BuildAddName(client);
+			Client_SendBuf(other, name, SEND_NORMAL);
+		}
+		if(!Client_IsVisible(other, client)) continue;
+		if(updates & PCU_MODEL) {
+			if(!model) model = CPE_BuildSetModel(client);
+			Client_SendBuf(other, model, SEND_NORMAL);
+		}
+		if(updates & PCU_SKIN) {
+			Proto_ResetRelay(other, client);
+			cs_bool extended = Client_GetExtVer(other, EXT_ENTPOS) != 0;
+			if(!ent[extended]) ent[extended] = CPE_BuildAddEntity2(client, extended);
+			Client_SendBuf(other, ent[extended], SEND_NORMAL);
+		}
+		if(updates & PCU_ENTPROP)
+			for(cs_int8 i = 0; i < 3; i++) {
+				if(!prop[i]) prop[i] = CPE_BuildSetEntityProperty(client, i, cpd->rotation[i]);
+				Client_SendBuf(other, prop[i], SEND_NORMAL);
+			}
 	}
 
+	if(name) PacketBuf_Release(name);
+	if(model) PacketBuf_Release(model);
+	for(cs_int32 i = 0; i < 2; i++)
+		if(ent[i]) PacketBuf_Release(ent[i]);
+	for(cs_int32 i = 0; i < 3; i++)
+		if(prop[i]) PacketBuf_Release(prop[i]);
+
+	return true;
+}
+
+#define QUEUE_INLINE_MAX 32
+
+PacketBuf *PacketBuf_Create(cs_uint16 size) {
+	PacketBuf *buf = Memory_Alloc(1, sizeof(PacketBuf) + size);
+	buf->data = (cs_char *)(buf + 1);
+	buf->size = size;
+	buf->refs = 1;
+	return buf;
+}
+
+void PacketBuf_Grab(PacketBuf *buf) {
+	Atomic_Inc(&buf->refs);
+}
+
+void PacketBuf_Release(PacketBuf *buf) {
+	if(Atomic_Dec(&buf->refs) == 0)
+		Memory_Free(buf);
+}
+
+static CQueueEntry *QueueEntry(CQueue *q, cs_uint32 idx) {
+	return &q->entries[(q->ehead + idx) % CQUEUE_ENTRIES];
+}
+
+/*
+** Убирает из очереди n отправленных байт,
+** освобождая полностью отправленные записи.
+*/
+static void QueueConsume(CQueue *q, cs_uint32 n) {
+	while(n > 0) {
+		CQueueEntry *e = QueueEntry(q, 0);
+		cs_uint32 take = min(n, e->len);
+		e->ptr += take;
+		e->len -= take;
+		q->pending -= take;
+		n -= take;
+
+		if(!e->buf) {
+			q->head = (q->head + take) % q->size;
+			q->used -= take;
+		}
+
+		if(e->len == 0) {
+			if(e->buf) PacketBuf_Release(e->buf);
+			q->ehead = (q->ehead + 1) % CQUEUE_ENTRIES;
+			q->ecount--;
+		}
+	}
+
+	if(q->used == 0) q->head = 0;
+}
+
+static void QueueClear(CQueue *q) {
+	for(cs_uint32 i = 0; i < q->ecount; i++) {
+		CQueueEntry *e = QueueEntry(q, i);
+		if(e->buf) PacketBuf_Release(e->buf);
+	}
+	q->ecount = 0;
+}
+
+/*
+** Дописывает в сокет 0x03 пакет из файла мира,
+** который sendfile успел отправить лишь частично.
+** Пока он не ушёл целиком, в сокет нельзя писать
+** ничего другого. Возвращает false, если пакет
+** так и остался недописанным.
+*/
+static cs_bool FinishFilePacket(Client *client, cs_bool wait) {
+	CMapStream *ms = &client->mapstream;
+
+	while(ms->file && (ms->offset - ms->start) % WORLD_CHUNK_PACKET != 0) {
+		cs_int32 left = WORLD_CHUNK_PACKET - (ms->offset - ms->start) % WORLD_CHUNK_PACKET,
+		ret = Socket_SendFile(client->sock, ms->file, ms->offset, left);
+		if(ret > 0) {
+			ms->offset += ret;
+			continue;
+		}
+
+		if(ret < 0 && Socket_WouldBlock()) {
+			if(wait && Socket_WaitWrite(client->sock, QUEUE_WAIT_TIMEOUT)) continue;
+			return false;
+		}
+
+		client->closed = true;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+** Начинает очередной WebSocket фрейм. Браузерный
+** клиент читает WebSocket как поток байт, так что
+** пакетам не нужны свои фреймы: всё, что накопилось
+** в очереди, уходит одним фреймом. Если с клиентом
+** договорились о сжатии, пакеты, собранные сервером,
+** сжимаются в одно сообщение, а уже сжатые куски
+** карты уходят обычными фреймами.
+*/
+static cs_bool StartWsFrame(Client *client) {
+	CQueue *q = &client->queue;
+	WebSock *ws = client->websock;
+	cs_byte opcode = 0x02;
+	cs_uint32 len = 0;
+
+	// Управляющий фрейм собран целиком, свой заголовок ему не нужен
+	CQueueEntry *first = QueueEntry(q, 0);
+	if(first->kind == QENTRY_CONTROL) {
+		q->frameleft = first->len;
+		q->framehdrlen = q->framehdrsent = 0;
+		return true;
+	}
+
+	if(ws->deflate && first->kind == QENTRY_PACKET) {
+		SockVec vec[SOCK_MAX_VEC];
+		cs_int32 count = 0;
+		for(cs_uint32 i = 0; i < q->ecount && count < SOCK_MAX_VEC && len < QUEUE_DEFLATE_MAX; i++) {
+			CQueueEntry *e = QueueEntry(q, i);
+			if(e->kind != QENTRY_PACKET) break;
+			vec[count].buf = e->ptr;
+			vec[count].len = min(e->len, QUEUE_DEFLATE_MAX - len);
+			len += vec[count++].len;
+		}
+
+		cs_int32 zlen = WebSock_Deflate(ws, vec, count, &q->zdata);
+		if(zlen < 0) {
+			client->closed = true;
+			return false;
+		}
+		QueueConsume(q, len);
+		q->zleft = len = (cs_uint32)zlen;
+		opcode |= WS_RSV1;
+	} else {
+		for(cs_uint32 i = 0; i < q->ecount && len < 0xFFFF; i++) {
+			CQueueEntry *e = QueueEntry(q, i);
+			if(e->kind == QENTRY_CONTROL || (ws->deflate && e->kind == QENTRY_PACKET)) break;
+			len += e->len;
+		}
+		q->frameleft = len = min(len, 0xFFFF);
+	}
+
+	q->framehdrlen = WebSock_WriteHeader(q->framehdr, opcode, (cs_uint16)len);
+	q->framehdrsent = 0;
+	return true;
+}
+
+/*
+** Отправляет содержимое очереди клиента одним
+** вызовом writev, собирая в него сразу несколько
+** записей очереди. Если wait равен false, то
+** неотправленное остаётся в очереди до следующего
+** тика сервера. Мьютекс клиента должен быть залочен.
+*/
+static cs_bool FlushQueue(Client *client, cs_bool wait) {
+	CQueue *q = &client->queue;
+	if(!FinishFilePacket(client, wait))
+		return !wait && !client->closed;
+
+	while(q->ecount > 0 || q->zleft > 0) {
+		SockVec vec[SOCK_MAX_VEC];
+		cs_int32 count = 0;
+		cs_uint32 limit = q->pending, hdrleft = 0;
+
+		if(client->websock) {
+			if(q->frameleft == 0 && q->zleft == 0 && !StartWsFrame(client))
+				return false;
+			hdrleft = q->framehdrlen - q->framehdrsent;
+			if(hdrleft > 0) {
+				vec[count].buf = q->framehdr + q->framehdrsent;
+				vec[count++].len = hdrleft;
+			}
+			if(q->zleft > 0) {
+				vec[count].buf = q->zdata;
+				vec[count++].len = q->zleft;
+			}
+			limit = q->frameleft;
+		}
+
+		for(cs_uint32 i = 0; i < q->ecount && count < SOCK_MAX_VEC && limit > 0; i++) {
+			CQueueEntry *e = QueueEntry(q, i);
+			vec[count].buf = e->ptr;
+			vec[count].len = min(e->len, limit);
+			limit -= vec[count++].len;
+		}
+
+		cs_int32 ret = Socket_SendV(client->sock, vec, count);
+		if(ret > 0) {
+			cs_uint32 sent = (cs_uint32)ret;
+			if(hdrleft > 0) {
+				cs_uint32 hdrpart = min(sent, hdrleft);
+				q->framehdrsent += hdrpart;
+				sent -= hdrpart;
+			}
+			if(q->zleft > 0) {
+				q->zdata += sent;
+				q->zleft -= sent;
+				continue;
+			}
+			if(client->websock) q->frameleft -= sent;
+			QueueConsume(q, sent);
+			continue;
+		}
+
+		if(ret < 0 && Socket_WouldBlock()) {
+			if(!wait) return true;
+			if(Socket_WaitWrite(client->sock, QUEUE_WAIT_TIMEOUT)) continue;
+			return false;
+		}
+
+		client->closed = true;
+		return false;
+	}
+
+	return true;
+}
+
+static void QueueAddEntry(CQueue *q, const cs_char *ptr, cs_uint32 len, PacketBuf *buf, cs_byte kind) {
+	if(!buf && q->ecount > 0) {
+		CQueueEntry *last = QueueEntry(q, q->ecount - 1);
+		if(!last->buf && last->kind == kind && last->ptr + last->len == ptr) {
+			last->len += len;
+			return;
+		}
+	}
+
+	CQueueEntry *e = QueueEntry(q, q->ecount++);
+	e->ptr = ptr;
+	e->len = len;
+	e->buf = buf;
+	e->kind = kind;
+}
+
+static void QueueWrite(CQueue *q, const cs_char *buf, cs_uint32 len, cs_byte kind) {
+	cs_uint32 tail = (q->head + q->used) % q->size,
+	first = min(len, q->size - tail);
+
+	Memory_Copy(q->data + tail, buf, first);
+	QueueAddEntry(q, q->data + tail, first, NULL, kind);
+	if(len > first) {
+		Memory_Copy(q->data, buf + first, len - first);
+		QueueAddEntry(q, q->data, len - first, NULL, kind);
+	}
+
+	q->used += len;
+	q->pending += len;
+}
+
+static cs_bool QueueHasSpace(CQueue *q, cs_uint32 len) {
+	return q->size - q->pending >= len && CQUEUE_ENTRIES - q->ecount >= 3;
+}
+
+/*
+** Ставит пакет в очередь клиента. Если передан ref,
+** то данные пакета берутся из него, и, если пакет
+** не слишком мал, в очередь кладётся только ссылка.
+** Что лежит в buf, говорит kind (QENTRY_*).
+*/
+static cs_bool QueuePacket(Client *client, const cs_char *buf, cs_uint32 len, PacketBuf *ref, cs_byte mode, cs_byte kind) {
+	CQueue *q = &client->queue;
+
+	if(!QueueHasSpace(q, len)) {
+		FlushQueue(client, mode == SEND_WAIT);
+		if(client->closed) return false;
+
+		if(!QueueHasSpace(q, len)) {
+			if(mode == SEND_DROPPABLE && !QueueKick) {
+				q->dropped++;
+				return false;
+			}
+
+			Log_Warn(Lang_Get(Lang_ErrGrp, 5), client->id);
+			client->closed = true;
+			return false;
+		}
+	}
+
+	if(ref && len > QUEUE_INLINE_MAX) {
+		PacketBuf_Grab(ref);
+		QueueAddEntry(q, buf, len, ref, kind);
+		q->pending += len;
+	} else
+		QueueWrite(q, buf, len, kind);
+
+	if(q->pending >= QUEUE_FLUSH_THRESHOLD)
+		FlushQueue(client, false);
 	return true;
 }
 
 void Client_Free(Client *client) {
-	if(client->thread[0])
-		Thread_Join(client->thread[0]);
+	if(client->reactor)
+		Reactor_Remove(client);
+
+	if(client->thread)
+		Thread_Join(client->thread);
+
+	if(client->mapstream.cache)
+		World_ReleaseCache(client->mapstream.cache);
+	if(client->mapstream.file)
+		File_Close(client->mapstream.file);
 
-	if(client->id >= 0)
+	if(client->id >= 0) {
+		// Реакторы могут прямо сейчас перебирать список, см. Clients_CountAddr
+		Mutex_Lock(ListMutex);
 		Clients_List[client->id] = NULL;
+		Mutex_Unlock(ListMutex);
+	}
 
-	if(client->mutex) Mutex_Free(client->mutex);
-	if(client->websock) Memory_Free(client->websock);
+	if(client->mutex) {
+		/*
+		** Пытаемся отправить то, что осталось в очереди,
+		** например, пакет с причиной кика.
+		*/
+		Mutex_Lock(client->mutex);
+		FlushQueue(client, false);
+		Mutex_Unlock(client->mutex);
+		Mutex_Free(client->mutex);
+	}
+	if(client->websock) WebSock_Free(client->websock);
 	if(client->rdbuf) Memory_Free(client->rdbuf);
 	if(client->wrbuf) Memory_Free(client->wrbuf);
+	if(client->queue.entries) {
+		QueueClear(&client->queue);
+		Memory_Free(client->queue.entries);
+	}
+	if(client->queue.data) Memory_Free(client->queue.data);
 
 	PlayerData *pd = client->playerData;
 
@@ -814,7 +1346,109 @@ void Client_Free(Client *client) {
 	Memory_Free(client);
 }
 
-cs_int32 Client_Send(Client *client, cs_int32 len) {
+/*
+** Та часть отключения клиента, что может надолго
+** заблокировать поток: ожидание реактора и потока
+** отправки карты. Память клиента после неё
+** освобождает основной поток.
+*/
+static void ReleaseClient(Client *client) {
+	if(client->reactor)
+		Reactor_Remove(client);
+
+	if(client->thread) {
+		Thread_Join(client->thread);
+		client->thread = NULL;
+	}
+}
+
+/*
+** Пакет об удалении из списка игроков собирается
+** один раз и рассылается из основного потока, пока
+** все клиенты в Clients_List ещё гарантированно живы.
+*/
+static void BroadcastRemoveName(Client *client) {
+	PacketBuf *buf = CPE_BuildRemoveName(client);
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *other = Clients_List[i];
+		if(other && other != client && Client_GetExtVer(other, EXT_PLAYERLIST))
+			Client_SendBuf(other, buf, SEND_NORMAL);
+	}
+	PacketBuf_Release(buf);
+}
+
+/*
+** Сокет закрывается сразу, не дожидаясь фонового
+** потока. Перед этим в него дописывается очередь,
+** в которой может лежать причина кика, но только
+** если мьютекс клиента сейчас свободен.
+*/
+static void ShutdownClient(Client *client) {
+	if(Mutex_TryLock(client->mutex)) {
+		FlushQueue(client, false);
+		Mutex_Unlock(client->mutex);
+	}
+	Socket_Shutdown(client->sock, SD_BOTH);
+}
+
+THREAD_FUNC(ReaperThread) {
+	(void)param;
+
+	while(true) {
+		Client *client = NULL;
+		Mutex_Lock(ReapMutex);
+		if(ReapCount > 0) {
+			client = ReapQueue[ReapHead];
+			ReapHead = (ReapHead + 1) % MAX_CLIENTS;
+			ReapCount--;
+		}
+		Mutex_Unlock(ReapMutex);
+
+		if(!client) {
+			// Очередь разобрана, так что остановка ничего не потеряет
+			if(!ReaperActive) break;
+			/*
+			** Сигнал сбрасывается до повторной проверки
+			** очереди, поэтому клиент, добавленный после
+			** неё, разбудит поток снова.
+			*/
+			Waitable_Wait(ReapWait);
+			Waitable_Reset(ReapWait);
+			continue;
+		}
+
+		ReleaseClient(client);
+		Mutex_Lock(ReapMutex);
+		client->reaped = true;
+		Mutex_Unlock(ReapMutex);
+	}
+
+	return 0;
+}
+
+/*
+** Клиент остаётся в Clients_List, пока фоновый
+** поток не закончит с ним. Из списка его убирает
+** и освобождает основной поток, так что рассылки
+** из других потоков не наткнутся на чужую память
+** раньше, чем это случилось бы и без фонового потока.
+*/
+static void ReapClient(Client *client) {
+	Mutex_Lock(ReapMutex);
+	client->reaping = true;
+	ReapQueue[(ReapHead + ReapCount++) % MAX_CLIENTS] = client;
+	Mutex_Unlock(ReapMutex);
+	Waitable_Signal(ReapWait);
+}
+
+static cs_bool IsReaped(Client *client) {
+	Mutex_Lock(ReapMutex);
+	cs_bool reaped = client->reaped;
+	Mutex_Unlock(ReapMutex);
+	return reaped;
+}
+
+cs_int32 Client_Send(Client *client, cs_int32 len, cs_byte mode) {
 	if(client->closed) return 0;
 	if(client == Broadcast) {
 		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
@@ -822,140 +1456,254 @@ cs_int32 Client_Send(Client *client, cs_int32 len) {
 
 			if(bClient && !bClient->closed) {
 				Mutex_Lock(bClient->mutex);
-				if(bClient->websock)
-					WebSock_SendFrame(bClient->websock, 0x02, client->wrbuf, (cs_uint16)len);
-				else
-					Socket_Send(client->sock, client->wrbuf, len);
+				QueuePacket(bClient, client->wrbuf, len, NULL, mode, QENTRY_PACKET);
 				Mutex_Unlock(bClient->mutex);
 			}
 		}
 		return len;
 	}
 
-	if(client->websock)
-		return WebSock_SendFrame(client->websock, 0x02, client->wrbuf, (cs_uint16)len);
-	else
-		return Socket_Send(client->sock, client->wrbuf, len);
+	return QueuePacket(client, client->wrbuf, len, NULL, mode, QENTRY_PACKET) ? len : 0;
 }
 
-static void PacketReceiverWs(Client *client) {
-	cs_byte packetId;
-	Packet *packet;
-	cs_bool extended;
-	cs_uint16 packetSize, recvSize;
-	WebSock *ws = client->websock;
-	cs_char *data = client->rdbuf;
-
-	if(WebSock_ReceiveFrame(ws)) {
-		if(ws->opcode == 0x08) {
-			client->closed = true;
-			return;
+cs_bool Client_SendBuf(Client *client, PacketBuf *buf, cs_byte mode) {
+	if(client == Broadcast) {
+		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+			Client *bClient = Clients_List[i];
+			if(bClient) Client_SendBuf(bClient, buf, mode);
 		}
+		return true;
+	}
 
-		recvSize = ws->plen - 1;
-		packet_handle:
-		packetId = *data++;
-		packet = Packet_Get(packetId);
+	if(client->closed) return false;
+	Mutex_Lock(client->mutex);
+	cs_bool ret = QueuePacket(client, buf->data, buf->len, buf, mode, QENTRY_PACKET);
+	Mutex_Unlock(client->mutex);
+	return ret;
+}
+
+/*
+** Сокет клиента неблокирующий, поэтому пакет может
+** прийти по частям. За одно срабатывание реактора
+** буфер заполняется одним recv, после чего из него
+** разбираются все целые пакеты, а недополученный
+** хвост остаётся в буфере до следующего раза.
+*/
+static cs_bool ReceiveRaw(Client *client, cs_char *buf, cs_int32 len, cs_int32 *got) {
+	cs_int32 ret = Socket_Receive(client->sock, buf, len, 0);
+	if(ret > 0) {
+		*got = ret;
+		return true;
+	}
+
+	if(ret == 0 || !Socket_WouldBlock())
+		client->closed = true;
+	return false;
+}
+
+static void HandlePackets(Client *client) {
+	cs_uint32 pos = 0;
+
+	while(!client->closed && pos < client->rdlen) {
+		cs_byte packetId = (cs_byte)client->rdbuf[pos];
+		Packet *packet = Packet_Get(packetId);
 		if(!packet) {
 			Log_Error(Lang_Get(Lang_ErrGrp, 2), packetId, client->id);
 			Client_Kick(client, Lang_Get(Lang_KickGrp, 7));
 			return;
 		}
 
-		packetSize = GetPacketSizeFor(packet, client, &extended);
+		/*
+		** Размер считается перед каждым пакетом: обработчик
+		** предыдущего мог включить клиенту CPE расширение.
+		*/
+		cs_bool extended;
+		cs_uint32 size = GetPacketSizeFor(packet, client, &extended) + 1;
+		if(client->rdlen - pos < size) break;
+		HandlePacket(client, client->rdbuf + pos + 1, packet, extended);
+		pos += size;
+	}
 
-		if(packetSize <= recvSize) {
-			HandlePacket(client, data, packet, extended);
-			/*
-			** Каждую ~секунду к фрейму с пакетом 0x08 (Teleport)
-			** приклеивается пакет 0x2B (TwoWayPing) и поскольку
-			** не исключено, что таких приклеиваний может быть
-			** много, пришлось использовать goto для обработки
-			** всех пакетов, входящих в фрейм.
-			*/
-			if(recvSize > packetSize) {
-				data += packetSize;
-				recvSize -= packetSize + 1;
-				goto packet_handle;
+	if(pos > 0) {
+		client->rdlen -= pos;
+		if(client->rdlen > 0)
+			Memory_Move(client->rdbuf, client->rdbuf + pos, client->rdlen);
+	}
+}
+
+/*
+** Pong уходит через очередь клиента, а не прямо
+** в сокет, чтобы не вклиниться посреди фрейма
+** с пакетами, отправленного лишь частично.
+*/
+static void QueuePong(Client *client) {
+	WebSock *ws = client->websock;
+	cs_char frame[4 + WS_CTRL_MAX];
+	cs_byte hdrlen = WebSock_WriteHeader(frame, 0x0A, ws->ctrllen);
+	Memory_Copy(frame + hdrlen, ws->ctrl, ws->ctrllen);
+	ws->pong = false;
+
+	Mutex_Lock(client->mutex);
+	QueuePacket(client, frame, hdrlen + ws->ctrllen, NULL, SEND_NORMAL, QENTRY_CONTROL);
+	Mutex_Unlock(client->mutex);
+}
+
+/*
+** Браузерный клиент шлёт те же пакеты, только внутри
+** WebSocket фреймов. Фреймы складываются в буфер
+** кодека, а их нагрузка (распакованная, если клиент
+** её сжимал) разбирается как обычный поток пакетов,
+** поэтому пакет может быть разрезан между фреймами.
+*/
+static void PacketReceiverWs(Client *client) {
+	WebSock *ws = client->websock;
+	cs_int32 got = 0, space = 0;
+
+	while(!client->closed) {
+		/*
+		** Сжатое сообщение может распаковаться в
+		** несколько буферов пакетов, так что кодек
+		** опустошается до того, как читать сокет.
+		*/
+		cs_uint32 out;
+		do {
+			out = WebSock_Decode(ws, client->rdbuf + client->rdlen, CLIENT_RDBUF_SIZE - client->rdlen);
+			client->rdlen += out;
+			HandlePackets(client);
+			if(ws->error != WS_ERR_SUCC) {
+				client->closed = true;
+				return;
 			}
+			if(ws->pong) QueuePong(client);
+		} while(out > 0 && !client->closed);
 
+		// Сокет прочитан не до конца только если буфер кончился раньше
+		if(got < space) return;
+		space = WS_RECVBUF_SIZE - ws->recvlen;
+		if(space == 0) {
+			client->closed = true;
 			return;
-		} else
-			Client_Kick(client, Lang_Get(Lang_KickGrp, 7));
-	} else
-		client->closed = true;
+		}
+		if(!ReceiveRaw(client, ws->recvbuf + ws->recvlen, space, &got)) return;
+		ws->recvlen += got;
+	}
 }
 
 static void PacketReceiverRaw(Client *client) {
-	Packet *packet;
-	cs_bool extended;
-	cs_uint16 packetSize;
-	cs_byte packetId;
+	cs_int32 got, space;
 
-	if(Socket_Receive(client->sock, (cs_char *)&packetId, 1, MSG_WAITALL) == 1) {
-		packet = Packet_Get(packetId);
-		if(!packet) {
-			Log_Error(Lang_Get(Lang_ErrGrp, 2), packetId, client->id);
-			Client_Kick(client, Lang_Get(Lang_KickGrp, 7));
+	while(!client->closed) {
+		space = CLIENT_RDBUF_SIZE - client->rdlen;
+		if(!ReceiveRaw(client, client->rdbuf + client->rdlen, space, &got)) return;
+		client->rdlen += got;
+		HandlePackets(client);
+		if(got < space) return;
+	}
+}
+
+static void CreateWebSock(Client *client) {
+	WebSock *wscl = Memory_Alloc(1, sizeof(WebSock));
+	wscl->proto = "ClassiCube";
+	wscl->recvbuf = Memory_Alloc(WS_RECVBUF_SIZE, 1);
+	wscl->zbits = WsDeflateBits;
+	wscl->sock = client->sock;
+	client->websock = wscl;
+}
+
+static void AddClient(Client *client) {
+	if(Client_Add(client))
+		client->netstate = NET_READY;
+	else
+		Client_Kick(client, Lang_Get(Lang_KickGrp, 1));
+}
+
+void Client_Receive(Client *client) {
+	if(client->netstate == NET_SNIFF) {
+		cs_int32 len = Socket_Receive(client->sock, client->rdbuf, 5, MSG_PEEK);
+		if(len < 5) {
+			if(len == 0 || (len < 0 && !Socket_WouldBlock()))
+				client->closed = true;
 			return;
 		}
 
-		packetSize = GetPacketSizeFor(packet, client, &extended);
-
-		if(packetSize > 0) {
-			cs_int32 len = Socket_Receive(client->sock, client->rdbuf, packetSize, MSG_WAITALL);
+		if(String_CaselessCompare2(client->rdbuf, "GET /", 5)) {
+			CreateWebSock(client);
+			client->netstate = NET_HANDSHAKE;
+			client->nettimeout = Time_GetMSec() + REACTOR_HANDSHAKE_TIMEOUT;
+		} else
+			AddClient(client);
+	}
 
-			if(packetSize == len)
-				HandlePacket(client, client->rdbuf, packet, extended);
-			else
+	if(client->netstate == NET_HANDSHAKE) {
+		if(!WebSock_DoHandshake(client->websock)) {
+			if(client->websock->error != WS_ERR_SUCC)
 				client->closed = true;
+			return;
 		}
-	} else
-		client->closed = true;
-}
+		AddClient(client);
+	}
 
-THREAD_FUNC(ClientThread) {
-	Client *client = (Client *)param;
+	if(client->netstate != NET_READY) return;
 
-	while(!client->closed) {
-		if(client->websock)
-			PacketReceiverWs(client);
-		else
-			PacketReceiverRaw(client);
+	if(client->websock)
+		PacketReceiverWs(client);
+	else
+		PacketReceiverRaw(client);
+}
 
-		if(client->thread[1]) {
-			Thread_Join(client->thread[1]);
-			client->thread[1] = NULL;
-		}
+cs_int32 Clients_CountAddr(cs_uint32 addr) {
+	cs_int32 count = 0;
+
+	Mutex_Lock(ListMutex);
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *other = Clients_List[i];
+		if(other && other->addr == addr) count++;
 	}
+	Mutex_Unlock(ListMutex);
 
-	return 0;
+	return count;
 }
 
 cs_bool Client_Add(Client *client) {
 	cs_int8 maxplayers = Config_GetInt8ByKey(Server_Config, CFG_MAXPLAYERS_KEY);
+	cs_bool added = false;
+
+	Mutex_Lock(ListMutex);
 	for(ClientID i = 0; i < min(maxplayers, MAX_CLIENTS); i++) {
 		if(!Clients_List[i]) {
 			client->id = i;
-			client->thread[0] = Thread_Create(ClientThread, client, false);
 			Clients_List[i] = client;
-			return true;
+			added = true;
+			break;
 		}
 	}
-	return false;
+	Mutex_Unlock(ListMutex);
+
+	return added;
 }
 
 static void SendSpawnPacket(Client *client, Client *other) {
+	Proto_ResetRelay(client, other);
 	if(Client_GetExtVer(client, EXT_PLAYERLIST))
 		CPE_WriteAddEntity2(client, other);
 	else
 		Vanilla_WriteSpawn(client, other);
 }
 
+static void SpawnEntity(Client *client, Client *other) {
+	SendSpawnPacket(client, other);
+	if(Client_GetExtVer(client, EXT_CHANGEMODEL))
+		CPE_WriteSetModel(client, other);
+}
+
 cs_bool Client_Spawn(Client *client) {
 	PlayerData *pd = client->playerData;
 	if(pd->spawned) return false;
 
+	World_GridSetPos(pd->world, client->id,
+		(cs_int32)pd->position.x, (cs_int32)pd->position.y, (cs_int32)pd->position.z
+	);
+
 	Client_UpdateWorldInfo(client, pd->world, true);
 
 	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
@@ -969,18 +1717,13 @@ cs_bool Client_Spawn(Client *client) {
 				CPE_WriteAddName(client, other);
 		}
 
-		if(Client_IsInSameWorld(client, other)) {
-			SendSpawnPacket(other, client);
-
-			if(Client_GetExtVer(other, EXT_CHANGEMODEL))
-				CPE_WriteSetModel(other, client);
-
-			if(client != other) {
-				SendSpawnPacket(client, other);
-
-				if(Client_GetExtVer(client, EXT_CHANGEMODEL))
-					CPE_WriteSetModel(client, other);
-			}
+		/*
+		** При ограниченном радиусе обзора остальных
+		** игроков заспавнит Clients_UpdateVisibility.
+		*/
+		if(Client_IsInSameWorld(client, other) && (client == other || ViewRadius == 0)) {
+			SpawnEntity(other, client);
+			if(client != other) SpawnEntity(client, other);
 		}
 	}
 
@@ -990,6 +1733,80 @@ cs_bool Client_Spawn(Client *client) {
 	return true;
 }
 
+/*
+** Игроки спавнятся друг у друга, подойдя ближе
+** ViewRadius, а пропадают, только отойдя дальше
+** ViewRadius + VIEW_HYSTERESIS, чтобы стоящий на
+** границе игрок не мигал. Соседи ищутся в клетках
+** сетки мира вокруг зрителя, сторона клетки равна
+** дальнему радиусу, поэтому хватает 3x3 клеток.
+*/
+static cs_bool IsGridMember(Client *client, World *world) {
+	return client && !client->closed && Client_IsInGame(client) &&
+	client->playerData->spawned && client->playerData->world == world;
+}
+
+static void UpdateVisibility(World *world) {
+	WorldGrid *grid = &world->grid;
+	cs_int32 far = ViewRadius + VIEW_HYSTERESIS;
+	cs_int64 nearSq = (cs_int64)ViewRadius * ViewRadius,
+	farSq = (cs_int64)far * far;
+	cs_bool empty = true;
+
+	World_GridClear(world, far);
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		if(IsGridMember(Clients_List[i], world)) {
+			World_GridInsert(world, i);
+			empty = false;
+		}
+	}
+	if(empty) return;
+
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(!IsGridMember(client, world)) continue;
+		PlayerData *pd = client->playerData;
+		cs_byte inrange[CLIENTMASK_SIZE] = {0};
+
+		cs_int32 center = World_GridCell(world, grid->x[i], grid->z[i]),
+		cx = center % grid->width, cz = center / grid->width;
+		for(cs_int32 z = max(cz - 1, 0); z <= min(cz + 1, grid->depth - 1); z++) {
+			for(cs_int32 x = max(cx - 1, 0); x <= min(cx + 1, grid->width - 1); x++) {
+				for(ClientID j = grid->cells[z * grid->width + x]; j != -1; j = grid->next[j]) {
+					if(j == i) continue;
+					cs_int64 dx = grid->x[j] - grid->x[i],
+					dy = grid->y[j] - grid->y[i],
+					dz = grid->z[j] - grid->z[i],
+					distSq = dx * dx + dy * dy + dz * dz;
+					if(distSq > farSq) continue;
+
+					ClientMask_Set(inrange, j);
+					if(distSq <= nearSq && !ClientMask_Test(pd->visible, j)) {
+						ClientMask_Set(pd->visible, j);
+						SpawnEntity(client, Clients_List[j]);
+					}
+				}
+			}
+		}
+
+		for(ClientID j = 0; j < MAX_CLIENTS; j++) {
+			if(ClientMask_Test(pd->visible, j) && !ClientMask_Test(inrange, j)) {
+				ClientMask_Clear(pd->visible, j);
+				Client *other = Clients_List[j];
+				if(other) Vanilla_WriteDespawn(client, other);
+			}
+		}
+	}
+}
+
+void Clients_UpdateVisibility(void) {
+	if(ViewRadius == 0) return;
+	for(WorldID i = 0; i < MAX_WORLDS; i++) {
+		World *world = Worlds_List[i];
+		if(world) UpdateVisibility(world);
+	}
+}
+
 void Client_Kick(Client *client, cs_str reason) {
 	if(client->closed) return;
 	if(!reason) reason = Lang_Get(Lang_KickGrp, 0);
@@ -1001,22 +1818,132 @@ void Client_Kick(Client *client, cs_str reason) {
 	** сокет клиента после кика, если цикл сервера
 	** в основом потоке уже не работает.
 	*/
-	if(!Server_Active) Client_Tick(client, 0);
+	if(!Server_Active && !client->reactor) Client_Tick(client, 0);
+}
+
+/*
+** Интервал между обновлениями удваивается, если
+** время приёма-передачи (RTT) клиента или объём его неотправленной очереди
+** растёт, и плавно уменьшается, когда оба приходят
+** в норму.
+*/
+static void UpdateRate(Client *client) {
+	CRate *rate = &client->rate;
+	cs_uint64 now = Time_GetMSec();
+
+	if(now - rate->checked >= RATE_CHECK_INTERVAL) {
+		rate->checked = now;
+		// pingTime хранит половину времени приёма-передачи
+		cs_uint32 rtt = client->cpeData ? client->cpeData->pingTime * 2 : 0,
+		backlog = client->queue.pending,
+		old = rate->interval;
+
+		if(backlog > QueueSize / 8 || rtt > RATE_RTT_HIGH)
+			rate->interval = min(max(rate->interval * 2, RATE_STEP), RATE_MAX_INTERVAL);
+		else if(backlog < QueueSize / 32 && rtt < RATE_RTT_LOW)
+			rate->interval = rate->interval > RATE_STEP ? rate->interval - RATE_STEP : 0;
+
+		if(rate->interval != old)
+			Log_Debug(Lang_Get(Lang_DbgGrp, 2), client->id, rate->interval, rtt, backlog);
+	}
+
+	rate->due = now >= rate->next;
+	if(rate->due) {
+		rate->next = now + rate->interval;
+		if(rate->hudmask) FlushHud(client);
+	}
+}
+
+/*
+** Поток карты из файла мира уходит в сокет через
+** sendfile, минуя очередь, поэтому начинать его
+** можно, только когда очередь полностью пуста.
+** Пакеты, вставшие в очередь за это время, уйдут
+** на следующем тике, сразу после того, как
+** FlushQueue допишет начатый 0x03 пакет.
+*/
+static cs_bool PumpMapFile(Client *client) {
+	CMapStream *ms = &client->mapstream;
+
+	while(ms->offset < ms->end) {
+		if(client->closed || client->queue.ecount > 0) return false;
+		cs_int64 len = ms->end - ms->offset;
+		if(MapSendRate > 0) {
+			if(MapTokens < WORLD_CHUNK_PACKET) return false;
+			len = min(len, MapTokens);
+		}
+		cs_int32 ret = Socket_SendFile(client->sock, ms->file, ms->offset, (cs_int32)len);
+		if(ret > 0) {
+			ms->offset += ret;
+			if(MapSendRate > 0) MapTokens -= ret;
+			continue;
+		}
+
+		if(ret < 0 && Socket_WouldBlock()) return false;
+		client->closed = true;
+		return false;
+	}
+
+	File_Close(ms->file);
+	ms->file = NULL;
+	ms->admitted = false;
+	return true;
+}
+
+/*
+** Куски карты докладываются в очередь, только
+** пока в ней лежит меньше половины её размера.
+** Так пакеты из других потоков (чат, пинг, кик)
+** встают между кусками карты, а мьютекс клиента
+** держится не дольше одного неблокирующего
+** прохода по сокету. Возвращает true, когда
+** в очередь встал последний кусок.
+*/
+static cs_bool PumpMapStream(Client *client) {
+	CMapStream *ms = &client->mapstream;
+	CQueue *q = &client->queue;
+	if(!ms->admitted) return false;
+	if(ms->file) return PumpMapFile(client);
+	if(!ms->cache) return false;
+
+	while(ms->chunk < ms->cache->chunks) {
+		if(client->closed || q->pending >= q->size / 2) return false;
+		if(MapSendRate > 0 && MapTokens < WORLD_CHUNK_PACKET) return false;
+		const cs_char *packet = (const cs_char *)ms->cache->data + ms->chunk * WORLD_CHUNK_PACKET;
+		if(!QueuePacket(client, packet, WORLD_CHUNK_PACKET, NULL, SEND_NORMAL, QENTRY_PACKED)) return false;
+		if(MapSendRate > 0) MapTokens -= WORLD_CHUNK_PACKET;
+		ms->chunk++;
+	}
+
+	World_ReleaseCache(ms->cache);
+	ms->cache = NULL;
+	ms->admitted = false;
+	return true;
 }
 
 void Client_Tick(Client *client, cs_int32 delta) {
 	PlayerData *pd = client->playerData;
 	if(client->closed) {
+		if(client->reaping) {
+			if(IsReaped(client)) Client_Free(client);
+			return;
+		}
+
 		if(pd && pd->state > STATE_WLOADDONE) {
-			for(int i = 0; i < MAX_CLIENTS; i++) {
-				Client *other = Clients_List[i];
-				if(other && Client_GetExtVer(other, EXT_PLAYERLIST))
-					CPE_WriteRemoveName(other, client);
-			}
+			BroadcastRemoveName(client);
 			Event_Call(EVT_ONDISCONNECT, client);
 		}
 		Client_Despawn(client);
-		Client_Free(client);
+
+		// Когда сервер уже остановлен, ждать некому
+		if(!Server_Active) {
+			ReleaseClient(client);
+			Client_Free(client);
+			return;
+		}
+
+		ShutdownClient(client);
+		ReapClient(client);
 		return;
 	}
 
@@ -1029,4 +1956,18 @@ void Client_Tick(Client *client, cs_int32 delta) {
 		client->pps = 0;
 		client->ppstm = 0;
 	}
+
+	UpdateRate(client);
+
+	/*
+	** Если мьютекс сейчас занят, то очередь
+	** будет отправлена тем, кто его держит,
+	** либо на следующем тике.
+	*/
+	if(Mutex_TryLock(client->mutex)) {
+		FlushQueue(client, false);
+		cs_bool streamed = PumpMapStream(client);
+		Mutex_Unlock(client->mutex);
+		if(streamed) FinishMapStream(client);
+	}
 }
@@ -25,6 +25,18 @@ enum {
 	STATE_INGAME // Игрок находится в игре
 };
 
+enum {
+	NET_SNIFF, // Ждём первые байты, чтобы определить тип подключения
+	NET_HANDSHAKE, // Браузерный клиент проходит WebSocket рукопожатие
+	NET_READY // Клиент добавлен в Clients_List и обменивается пакетами
+};
+
+enum {
+	SEND_NORMAL, // При переполнении очереди клиент будет отключён
+	SEND_DROPPABLE, // Пакет можно выбросить, если очередь переполнена
+	SEND_WAIT // Дождаться отправки части очереди, если место закончилось
+};
+
 enum {
 	PCU_NONE = BIT(0), // Ни одно из CPE-значений игрока не изменилось
 	PCU_GROUP = BIT(1), // Была обновлена группа игрока
@@ -39,6 +51,18 @@ enum {
 	ROT_Z = 2,
 };
 
+#define VIEW_HYSTERESIS 8 // Насколько дальше радиуса обзора должен отойти игрок, чтобы пропасть
+
+/*
+** Битовая маска игроков, индексом
+** в которой служит id игрока.
+*/
+#define CLIENTMASK_SIZE ((MAX_CLIENTS + 7) / 8)
+#define CLIENT_RDBUF_SIZE 4096 // Должен вмещать самый большой входящий пакет
+#define ClientMask_Test(mask, id) ((mask)[(id) / 8] & BIT((id) % 8))
+#define ClientMask_Set(mask, id) ((mask)[(id) / 8] |= BIT((id) % 8))
+#define ClientMask_Clear(mask, id) ((mask)[(id) / 8] &= ~BIT((id) % 8))
+
 typedef struct _CGroup {
 	cs_int16 id;
 	cs_byte rank;
@@ -79,37 +103,153 @@ typedef struct {
 	Ang angle; // Угол вращения игрока
 	cs_bool isOP, // Является ли игрок оператором
 	spawned, // Заспавнен ли игрок
-	firstSpawn; // Был лы этот спавн первым с момента захода на сервер
+	firstSpawn, // Был лы этот спавн первым с момента захода на сервер
+	moved; // Позиция изменилась, но ещё не была разослана другим игрокам
+	cs_int32 rawpos[3], // Позиция в том виде, в котором её прислал клиент (1/32 блока)
+	sentpos[3]; // Позиция, последний раз разосланная другим игрокам
+	cs_byte rawang[2], // Угол вращения в том виде, в котором его прислал клиент
+	sentang[2], // Угол вращения, последний раз разосланный другим игрокам
+	absmask[CLIENTMASK_SIZE], // Игроки, чьё следующее перемещение нужно прислать телепортом
+	visible[CLIENTMASK_SIZE], // Игроки, заспавненные у этого клиента при ограниченном радиусе обзора
+	stale[CLIENTMASK_SIZE]; // Игроки, чьи перемещения были пропущены регулятором частоты
 } PlayerData;
 
+/*
+** Неизменяемый буфер с готовым пакетом. Используется
+** при рассылке одного и того же пакета нескольким
+** клиентам: пакет собирается один раз, а в очередь
+** каждого получателя кладётся лишь ссылка на буфер.
+*/
+typedef struct _PacketBuf {
+	cs_int32 volatile refs; // Количество владельцев буфера
+	cs_uint16 size, // Размер выделенной под пакет памяти
+	len; // Длина собранного пакета
+	cs_char *data; // Данные пакета
+} PacketBuf;
+
+#define CQUEUE_ENTRIES 512
+
+enum {
+	QENTRY_PACKET, // Пакеты, собранные сервером
+	QENTRY_PACKED, // Уже сжатые куски карты, повторно их не сжимаем
+	QENTRY_CONTROL // Готовый управляющий WebSocket фрейм, уходит как есть
+};
+
+typedef struct {
+	const cs_char *ptr; // Начало неотправленных данных записи
+	cs_uint32 len; // Количество неотправленных байт записи
+	PacketBuf *buf; // NULL, если данные лежат в кольцевом буфере очереди
+	cs_byte kind; // Что лежит в записи, см. QENTRY_*
+} CQueueEntry;
+
+typedef struct {
+	cs_char *data; // Кольцевой буфер для пакетов, собранных только для этого клиента
+	CQueueEntry *entries; // Кольцо записей в порядке их отправки
+	cs_uint32 size, // Размер кольцевого буфера
+	head, // Смещение первого неотправленного байта кольцевого буфера
+	used, // Количество занятых байт кольцевого буфера
+	pending, // Общий объём неотправленных данных, включая общие буферы
+	ehead, // Индекс первой записи
+	ecount, // Количество записей
+	dropped, // Количество пакетов, выброшенных из-за переполнения
+	frameleft, // Сколько байт очереди ещё войдёт в начатый WebSocket фрейм
+	zleft; // Сколько байт сжатого фрейма ещё не отправлено
+	const cs_char *zdata; // Неотправленная часть сжатого фрейма
+	cs_char framehdr[4]; // Заголовок начатого фрейма
+	cs_byte framehdrlen,
+	framehdrsent; // Сколько байт заголовка уже отправлено
+} CQueue;
+
+#define RATE_CHECK_INTERVAL 250 // Как часто пересчитывается частота обновлений клиента, в мс
+#define RATE_STEP 50 // Шаг изменения интервала между обновлениями, в мс
+#define RATE_MAX_INTERVAL 1000 // Самый большой интервал между обновлениями, в мс
+#define RATE_RTT_HIGH 400 // RTT, при котором обновления начинают приходить реже
+#define RATE_RTT_LOW 200 // RTT, при котором частота обновлений восстанавливается
+#define RATE_HUD_SLOTS 7 // MT_STATUS1-3, MT_BRIGHT1-3 и MT_ANNOUNCE
+
+/*
+** Регулятор частоты некритичных обновлений:
+** перемещений других игроков, HUD-сообщений
+** и частиц. Когда у клиента растёт пинг или
+** очередь отправки, такие обновления начинают
+** приходить реже, а после восстановления
+** соединения - снова каждый тик.
+*/
+typedef struct {
+	cs_uint32 interval; // Минимальный промежуток между обновлениями в мс, 0 - каждый тик
+	cs_uint64 next, // Время, начиная с которого разрешено следующее обновление
+	checked; // Время последнего пересчёта интервала
+	cs_bool due; // Разрешены ли обновления на текущем тике
+	cs_byte hudmask; // Слоты HUD, в которых лежат неотправленные сообщения
+	cs_char hud[RATE_HUD_SLOTS][65]; // Последние неотправленные HUD-сообщения
+} CRate;
+
+/*
+** Карта отправляется либо из кэша мира, либо,
+** если мир не менялся с последнего сохранения,
+** прямо из его файла. В последнем случае пакеты
+** уходят в сокет в обход очереди клиента.
+*/
+typedef struct {
+	WorldCache *cache; // Отправляемая клиенту сжатая карта
+	cs_uint32 chunk; // Номер следующего неотправленного куска карты
+	cs_file file; // Файл мира, из которого отправляется карта
+	cs_uint32 start, // Смещение потока карты в файле
+	offset, // Смещение следующего неотправленного байта
+	end; // Конец потока карты в файле
+	cs_int32 ticket; // Номер в очереди на отправку, чем меньше, тем раньше
+	cs_int32 position; // Последняя сообщённая клиенту позиция в очереди
+	cs_bool admitted, // Карта отправляется, а не ждёт своей очереди
+	reload; // Игрок получает заново карту мира, в котором уже находится
+} CMapStream;
+
+#define MapStream_IsActive(ms) ((ms)->cache != NULL || (ms)->file != NULL)
+
 typedef struct {
 	cs_bool closed; // В случае значения true сервер прекращает общение с клиентом и удаляет его
+	cs_bool reaping, // Клиент отключается в фоновом потоке
+	reaped; // Фоновый поток закончил, осталось освободить память
 	Socket sock; // Файловый дескриптор сокета клиента
 	ClientID id; // Используется в качестве entityid
-	void *thread[2]; // Потоки клиента
+	void *thread; // Поток отправки карты
+	struct _Reactor *reactor; // Реактор, следящий за сокетом клиента
+	cs_uint32 rslot; // Слот клиента в таблице реактора
+	cs_byte netstate; // Стадия подключения клиента
+	cs_uint64 nettimeout; // Время, до которого клиент должен завершить подключение
 	CPEData *cpeData; // В случае vanilla клиента эта структура не создаётся
 	PlayerData *playerData; // Создаётся при получении hanshake пакета
 	KListField *headNode; // Последняя созданная ассоциативная нода у клиента
 	WebSock *websock; // Создаётся, если клиент был определён как браузерный
 	Mutex *mutex; // Мьютекс записи, на время отправки пакета клиенту он лочится
 	cs_char *rdbuf, // Буфер для получения пакетов от клиента
-	*wrbuf; // Буфер для отправки пакетов клиенту
-	cs_uint32 pps, // Количество пакетов, отправленных игроком за секунду
+	*wrbuf; // Буфер для сборки пакетов перед постановкой в очередь
+	CQueue queue; // Очередь исходящих пакетов
+	CRate rate; // Регулятор частоты некритичных обновлений
+	CMapStream mapstream; // Карта, которая отправляется клиенту в фоне
+	cs_uint32 rdlen, // Количество байт в rdbuf, ещё не разобранных на пакеты
+	pps, // Количество пакетов, отправленных игроком за секунду
 	ppstm, // Таймер для счётчика пакетов
 	addr; // ipv4 адрес клиента
 } Client;
 
-cs_int32 Client_Send(Client *client, cs_int32 len);
+cs_int32 Client_Send(Client *client, cs_int32 len, cs_byte mode);
+cs_bool Client_SendBuf(Client *client, PacketBuf *buf, cs_byte mode);
 cs_bool Client_CheckAuth(Client *client);
 void Client_Free(Client *client);
 void Client_Tick(Client *client, cs_int32 delta);
 Client *Client_New(Socket fd, cs_uint32 addr);
 cs_bool Client_Add(Client *client);
+void Client_Receive(Client *client);
 void Client_Init(void);
+void Client_Uninit(void);
 cs_bool Client_BulkBlockUpdate(Client *client, BulkBlockUpdate *bbu);
 cs_bool Client_DefineBlock(Client *client, BlockDef *block);
 cs_bool Client_UndefineBlock(Client *client, BlockID id);
 
+API PacketBuf *PacketBuf_Create(cs_uint16 size);
+API void PacketBuf_Grab(PacketBuf *buf);
+API void PacketBuf_Release(PacketBuf *buf);
+
 API cs_uint16 Assoc_NewType(void);
 API cs_bool Assoc_DelType(cs_uint16 type, cs_bool freeData);
 API cs_bool Assoc_Set(Client *client, cs_uint16 type, void *ptr);
@@ -122,9 +262,14 @@ API cs_bool Group_Remove(cs_int16 gid);
 
 API cs_byte Clients_GetCount(cs_int32 state);
 API void Clients_KickAll(cs_str reason);
+// Сколько клиентов из Clients_List подключено с адреса addr, можно звать из любого потока
+cs_int32 Clients_CountAddr(cs_uint32 addr);
 API void Clients_UpdateWorldInfo(World *world);
+void Clients_UpdateVisibility(void);
+void Clients_UpdateTransfers(cs_int32 delta);
 
 API cs_bool Client_ChangeWorld(Client *client, World *world);
+API cs_bool Client_ReloadWorld(Client *client);
 API void Client_Chat(Client *client, cs_byte type, cs_str message);
 API void Client_Kick(Client *client, cs_str reason);
 API void Client_UpdateWorldInfo(Client *client, World *world, cs_bool updateAll);
@@ -135,9 +280,11 @@ API cs_bool Client_RemoveSelection(Client *client, cs_byte id);
 API cs_bool Client_TeleportTo(Client *client, Vec *pos, Ang *ang);
 
 API cs_bool Client_IsInSameWorld(Client *client, Client *other);
+API cs_bool Client_IsVisible(Client *client, Client *other);
 API cs_bool Client_IsInWorld(Client *client, World *world);
 API cs_bool Client_IsInGame(Client *client);
 API cs_bool Client_IsOP(Client *client);
+API cs_uint32 Client_GetUpdateInterval(Client *client);
 
 API cs_bool Client_SetWeather(Client *client, cs_int8 type);
 API cs_bool Client_SetInvOrder(Client *client, cs_byte order, BlockID block);
@@ -48,6 +48,7 @@ typedef unsigned int cs_size;
 #define max(a, b) (((a)>(b))?(a):(b))
 #define INVALID_SOCKET -1
 #define SD_SEND   SHUT_WR
+#define SD_BOTH   SHUT_RDWR
 #define MAX_PATH  PATH_MAX
 
 typedef __INT8_TYPE__ cs_int8;
@@ -117,6 +118,7 @@ EXP extern cs_int32 Plugin_ApiVer, Plugin_Version;
 #define CHATLINE "<%s>: %s"
 #define MAINCFG "server.cfg"
 #define WORLD_MAGIC 0x54414457
+#define WORLD_REGMAGIC 0x47455257
 #define PLUGIN_API_NUM 1
 
 #define MAX_PLUGINS 64
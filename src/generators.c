@@ -9,14 +9,10 @@ static cs_bool flatgenerator(World *world, void *data) {
 	WorldInfo *wi = &world->info;
 	SVec *dims = &wi->dimensions;
 
-	BlockID *blocks = World_GetBlockArray(world, NULL);
-	cs_int32 dirtEnd = dims->x * dims->z * (dims->y / 2 - 1);
-	for(cs_int32 i = 0; i < dirtEnd + dims->x * dims->z; i++) {
-		if(i < dirtEnd)
-			blocks[i] = 3;
-		else
-			blocks[i] = 2;
-	}
+	cs_uint32 layer = (cs_uint32)dims->x * (cs_uint32)dims->z,
+	dirtEnd = layer * (dims->y / 2 - 1);
+	World_FillBlocks(world, 0, dirtEnd, 3);
+	World_FillBlocks(world, dirtEnd, layer, 2);
 
 	World_SetProperty(world, PROP_CLOUDSLEVEL, dims->y + 2);
 	World_SetProperty(world, PROP_EDGELEVEL, dims->y / 2);
@@ -73,8 +69,11 @@ cs_bool Generators_Use(World *world, cs_str name, void *data) {
 	List_Iter(ptr, Generators_List) {
 		if(String_CaselessCompare(ptr->key.str, name)) {
 			struct GenRoutineStruct *grs = (struct GenRoutineStruct *)ptr->value.ptr;
-			if(grs) return grs->func(world, data);
-			break;
+			if(!grs) break;
+			cs_bool succ = grs->func(world, data);
+			// Генератор пишет блоки напрямую, минуя World_SetBlock
+			World_MarkModified(world);
+			return succ;
 		}
 	}
 
@@ -15,8 +15,9 @@ cs_bool Lang_Init(void) {
 	Lang_Set(Lang_ErrGrp, 2, "Invalid packet 0x%02X from Client[%d]");
 	Lang_Set(Lang_ErrGrp, 3, "Heartbeat error: %s.");
 	Lang_Set(Lang_ErrGrp, 4, "Not a websocket connection.");
+	Lang_Set(Lang_ErrGrp, 5, "Outbound queue of Client[%d] is full, disconnecting.");
 
-	Lang_ConGrp = Lang_NewGroup(8);
+	Lang_ConGrp = Lang_NewGroup(14);
 	if(!Lang_ConGrp) return false;
 	Lang_Set(Lang_ConGrp, 0, "Server started on %s:%d.");
 	Lang_Set(Lang_ConGrp, 1, "Last server tick took %dms!");
@@ -26,6 +27,12 @@ cs_bool Lang_Init(void) {
 	Lang_Set(Lang_ConGrp, 5, "Saving worlds...");
 	Lang_Set(Lang_ConGrp, 6, "Plugin \"%s\" is deprecated. Server uses PluginAPI v%03d, but plugin compiled for v%03d.");
 	Lang_Set(Lang_ConGrp, 7, "Please upgrade your server software. Plugin \"%s\" compiled for PluginAPI v%03d, but server uses v%d.");
+	Lang_Set(Lang_ConGrp, 8, "World \"%s\" saved in %dms, %d bytes written.");
+	Lang_Set(Lang_ConGrp, 9, "Replayed %d block changes from the journal of world \"%s\".");
+	Lang_Set(Lang_ConGrp, 10, "World \"%s\" loaded in %dms, worlds now take %d KB of memory.");
+	Lang_Set(Lang_ConGrp, 11, "World \"%s\" unloaded in %dms, worlds now take %d KB of memory.");
+	Lang_Set(Lang_ConGrp, 12, "World \"%s\" is now dormant, worlds now take %d KB of memory.");
+	Lang_Set(Lang_ConGrp, 13, "World \"%s\" woke up in %dms.");
 
 	Lang_KickGrp = Lang_NewGroup(11);
 	if(!Lang_KickGrp) return false;
@@ -49,10 +56,18 @@ cs_bool Lang_Init(void) {
 	Lang_Set(Lang_CmdGrp, 3, "Unknown command.");
 	Lang_Set(Lang_CmdGrp, 4, "This command can't be called from console.");
 
-	Lang_DbgGrp = Lang_NewGroup(2);
+	Lang_DbgGrp = Lang_NewGroup(6);
 	if(!Lang_DbgGrp) return false;
 	Lang_Set(Lang_DbgGrp, 0, "Symbol: %s - 0x%0X");
 	Lang_Set(Lang_DbgGrp, 1, "\tFile: %s: %d");
+	Lang_Set(Lang_DbgGrp, 2, "Client %d: update interval %dms (RTT %dms, %d bytes queued).");
+	Lang_Set(Lang_DbgGrp, 3, "Position relay: %d KB sent, %d KB saved by relative moves.");
+	Lang_Set(Lang_DbgGrp, 4, "Update rate: %d of %d players throttled, slowest interval %dms.");
+	Lang_Set(Lang_DbgGrp, 5, "Network thread %d: %d clients, %d accepted, %d events, busy %dms.");
+
+	Lang_MsgGrp = Lang_NewGroup(1);
+	if(!Lang_MsgGrp) return false;
+	Lang_Set(Lang_MsgGrp, 0, "&eWaiting for map download, position in queue: &f%d");
 	return true;
 }
 
@@ -65,6 +65,16 @@ void Memory_Copy(void *dst, const void *src, cs_size count) {
 	while(count--) *u8dst++ = *u8src++;
 }
 
+// В отличие от Memory_Copy, области могут перекрываться
+void Memory_Move(void *dst, const void *src, cs_size count) {
+	cs_byte *u8dst = (cs_byte *)dst,
+	*u8src = (cs_byte *)src;
+	if(u8dst <= u8src)
+		while(count--) *u8dst++ = *u8src++;
+	else
+		while(count--) u8dst[count] = u8src[count];
+}
+
 void Memory_Fill(void *dst, cs_size count, cs_byte val) {
 	cs_byte *u8dst = (cs_byte *)dst;
 	while(count--) *u8dst++ = val;
@@ -132,10 +142,29 @@ cs_bool File_Flush(cs_file fp) {
 	return fflush(fp) == 0;
 }
 
+#if defined(WINDOWS)
+#include <io.h>
+#elif defined(UNIX)
+#include <unistd.h>
+#endif
+
+cs_bool File_Sync(cs_file fp) {
+	if(fflush(fp) != 0) return false;
+#if defined(WINDOWS)
+	return _commit(_fileno(fp)) == 0;
+#elif defined(UNIX)
+	return fsync(fileno(fp)) == 0;
+#endif
+}
+
 cs_int32 File_Seek(cs_file fp, long offset, cs_int32 origin) {
 	return fseek(fp, offset, origin);
 }
 
+long File_Tell(cs_file fp) {
+	return ftell(fp);
+}
+
 cs_bool File_Close(cs_file fp) {
 	return fclose(fp) != 0;
 }
@@ -153,6 +182,8 @@ cs_bool Socket_Init(void) {
 	WSADATA ws;
 	return WSAStartup(MAKEWORD(1, 1), &ws) != SOCKET_ERROR;
 #else
+	// У sendfile нет аналога MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
 	return true;
 #endif
 }
@@ -205,6 +236,22 @@ cs_bool Socket_Bind(Socket sock, struct sockaddr_in *addr) {
 	return true;
 }
 
+/*
+** Разрешает нескольким сокетам слушать один и тот же
+** порт, подключения между ними распределяет ядро.
+** Вызывать нужно до Socket_Bind. Распределение
+** честно работает только на Linux, на остальных
+** системах функция ничего не делает.
+*/
+cs_bool Socket_SetReusePort(Socket sock) {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+	return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(cs_int32){1}, 4) == 0;
+#else
+	(void)sock;
+	return false;
+#endif
+}
+
 cs_bool Socket_Connect(Socket sock, struct sockaddr_in *addr) {
 	socklen_t len = sizeof(struct sockaddr_in);
 	return connect(sock, (struct sockaddr *)addr, len) == 0;
@@ -217,11 +264,42 @@ Socket Socket_Accept(Socket sock, struct sockaddr_in *addr) {
 
 #if defined(WINDOWS)
 #define SOCK_DFLAGS 0
+#define SOCK_POLL WSAPoll
+typedef WSAPOLLFD SOCK_POLLFD;
 #elif defined(UNIX)
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #define SOCK_DFLAGS MSG_NOSIGNAL
+#define SOCK_POLL poll
+typedef struct pollfd SOCK_POLLFD;
 #endif
 
+#define SOCK_SEND_TIMEOUT 5000
+
+cs_bool Socket_SetNonBlocking(Socket sock, cs_bool state) {
+#if defined(WINDOWS)
+	u_long mode = state;
+	return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#elif defined(UNIX)
+	cs_int32 flags = fcntl(sock, F_GETFL, 0);
+	if(flags == -1) return false;
+	if(state)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+	return fcntl(sock, F_SETFL, flags) == 0;
+#endif
+}
+
+cs_bool Socket_WouldBlock(void) {
+#if defined(WINDOWS)
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#elif defined(UNIX)
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
 cs_int32 Socket_Receive(Socket sock, cs_char *buf, cs_int32 len, cs_int32 flags) {
 	return recv(sock, buf, len, SOCK_DFLAGS | flags);
 }
@@ -246,8 +324,98 @@ cs_int32 Socket_ReceiveLine(Socket sock, cs_char *line, cs_int32 len) {
 	return start_len - len;
 }
 
+/*
+** Сокеты клиентов переведены в неблокирующий режим,
+** поэтому send может отправить только часть данных.
+** Дожидаемся освобождения буфера сокета, но не дольше
+** SOCK_SEND_TIMEOUT, чтобы зависший клиент не мог
+** навсегда заблокировать отправляющий поток.
+*/
 cs_int32 Socket_Send(Socket sock, const cs_char *buf, cs_int32 len) {
-	return send(sock, buf, len, 0);
+	cs_int32 sent = 0;
+
+	while(sent < len) {
+		cs_int32 ret = send(sock, buf + sent, len - sent, SOCK_DFLAGS);
+		if(ret > 0) {
+			sent += ret;
+			continue;
+		}
+
+		if(ret < 0 && Socket_WouldBlock() &&
+		Socket_WaitWrite(sock, SOCK_SEND_TIMEOUT))
+			continue;
+
+		break;
+	}
+
+	return sent;
+}
+
+/*
+** Отправляет несколько буферов одним системным вызовом.
+** В отличие от Socket_Send не ждёт освобождения буфера
+** сокета и может отправить только часть данных.
+*/
+cs_int32 Socket_SendV(Socket sock, SockVec *vec, cs_int32 count) {
+	if(count > SOCK_MAX_VEC) count = SOCK_MAX_VEC;
+#if defined(WINDOWS)
+	WSABUF bufs[SOCK_MAX_VEC];
+	DWORD sent = 0;
+	for(cs_int32 i = 0; i < count; i++) {
+		bufs[i].buf = (CHAR *)vec[i].buf;
+		bufs[i].len = (ULONG)vec[i].len;
+	}
+	if(WSASend(sock, bufs, (DWORD)count, &sent, 0, NULL, NULL) != 0)
+		return -1;
+	return (cs_int32)sent;
+#elif defined(UNIX)
+	struct iovec iov[SOCK_MAX_VEC];
+	struct msghdr msg = {0};
+	for(cs_int32 i = 0; i < count; i++) {
+		iov[i].iov_base = (void *)vec[i].buf;
+		iov[i].iov_len = (size_t)vec[i].len;
+	}
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	return (cs_int32)sendmsg(sock, &msg, SOCK_DFLAGS);
+#endif
+}
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#define SOCK_FILE_BUFFER 16384
+
+/*
+** Отправляет до len байт файла, начиная с offset,
+** не трогая текущую позицию в нём. На Linux данные
+** уходят в сокет прямо из кэша страниц ядра, на
+** остальных системах - через промежуточный буфер.
+** Как и Socket_SendV, не ждёт освобождения буфера
+** сокета и может отправить только часть данных.
+*/
+cs_int32 Socket_SendFile(Socket sock, cs_file fp, cs_uint32 offset, cs_int32 len) {
+#if defined(__linux__)
+	off_t off = (off_t)offset;
+	return (cs_int32)sendfile(sock, fileno(fp), &off, (size_t)len);
+#else
+	cs_char buf[SOCK_FILE_BUFFER];
+	if(len > SOCK_FILE_BUFFER) len = SOCK_FILE_BUFFER;
+	if(File_Seek(fp, (long)offset, SEEK_SET) != 0) return -1;
+	len = (cs_int32)File_Read(buf, 1, len, fp);
+	if(len <= 0) return -1;
+	return (cs_int32)send(sock, buf, len, SOCK_DFLAGS);
+#endif
+}
+
+cs_bool Socket_WaitWrite(Socket sock, cs_int32 timeout) {
+	SOCK_POLLFD pfd;
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	return SOCK_POLL(&pfd, 1, timeout) > 0 &&
+	(pfd.revents & POLLOUT) != 0;
 }
 
 void Socket_Shutdown(Socket sock, cs_int32 how) {
@@ -262,6 +430,164 @@ void Socket_Close(Socket sock) {
 #endif
 }
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+
+struct _Poller {
+	cs_int32 fd;
+	struct epoll_event events[POLLER_MAX_EVENTS];
+};
+
+Poller *Poller_Create(void) {
+	Poller *poller = Memory_Alloc(1, sizeof(Poller));
+	if((poller->fd = epoll_create1(0)) == -1) {
+		Memory_Free(poller);
+		return NULL;
+	}
+	return poller;
+}
+
+void Poller_Free(Poller *poller) {
+	close(poller->fd);
+	Memory_Free(poller);
+}
+
+cs_bool Poller_Add(Poller *poller, Socket sock, cs_uint64 key, cs_uint32 flags) {
+	struct epoll_event evt;
+	evt.data.u64 = key;
+	evt.events = EPOLLET | EPOLLRDHUP;
+	if(flags & POLLER_READ) evt.events |= EPOLLIN;
+	if(flags & POLLER_WRITE) evt.events |= EPOLLOUT;
+	return epoll_ctl(poller->fd, EPOLL_CTL_ADD, sock, &evt) == 0;
+}
+
+cs_bool Poller_Remove(Poller *poller, Socket sock) {
+	struct epoll_event evt = {0};
+	return epoll_ctl(poller->fd, EPOLL_CTL_DEL, sock, &evt) == 0;
+}
+
+cs_int32 Poller_Wait(Poller *poller, PollEvent *events, cs_int32 timeout) {
+	cs_int32 count = epoll_wait(poller->fd, poller->events, POLLER_MAX_EVENTS, timeout);
+
+	for(cs_int32 i = 0; i < count; i++) {
+		struct epoll_event *evt = &poller->events[i];
+		events[i].key = evt->data.u64;
+		events[i].flags = 0;
+		if(evt->events & EPOLLIN) events[i].flags |= POLLER_READ;
+		if(evt->events & EPOLLOUT) events[i].flags |= POLLER_WRITE;
+		if(evt->events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+			events[i].flags |= POLLER_HUP | POLLER_READ;
+	}
+
+	return count < 0 ? 0 : count;
+}
+#else
+/*
+** Запасной вариант для систем без epoll. Работает
+** в режиме level-triggered, поэтому обработчики
+** событий должны вычитывать сокет до WouldBlock,
+** как и в случае с epoll.
+*/
+struct _Poller {
+	Mutex *mutex;
+	SOCK_POLLFD *fds, *wfds;
+	cs_uint64 *keys, *wkeys;
+	cs_int32 count, cap;
+};
+
+Poller *Poller_Create(void) {
+	Poller *poller = Memory_Alloc(1, sizeof(Poller));
+	poller->mutex = Mutex_Create();
+	return poller;
+}
+
+void Poller_Free(Poller *poller) {
+	if(poller->cap > 0) {
+		Memory_Free(poller->fds);
+		Memory_Free(poller->wfds);
+		Memory_Free(poller->keys);
+		Memory_Free(poller->wkeys);
+	}
+	Mutex_Free(poller->mutex);
+	Memory_Free(poller);
+}
+
+static void *PollerGrow(void *ptr, cs_int32 cap, cs_int32 newcap, cs_size isize) {
+	if(!ptr) return Memory_Alloc(newcap, isize);
+	return Memory_Realloc(ptr, cap * isize, newcap * isize);
+}
+
+cs_bool Poller_Add(Poller *poller, Socket sock, cs_uint64 key, cs_uint32 flags) {
+	Mutex_Lock(poller->mutex);
+	if(poller->count == poller->cap) {
+		cs_int32 newcap = poller->cap ? poller->cap * 2 : 32;
+		poller->fds = PollerGrow(poller->fds, poller->cap, newcap, sizeof(SOCK_POLLFD));
+		poller->wfds = PollerGrow(poller->wfds, poller->cap, newcap, sizeof(SOCK_POLLFD));
+		poller->keys = PollerGrow(poller->keys, poller->cap, newcap, sizeof(cs_uint64));
+		poller->wkeys = PollerGrow(poller->wkeys, poller->cap, newcap, sizeof(cs_uint64));
+		poller->cap = newcap;
+	}
+	SOCK_POLLFD *pfd = &poller->fds[poller->count];
+	pfd->fd = sock;
+	pfd->events = 0;
+	pfd->revents = 0;
+	if(flags & POLLER_READ) pfd->events |= POLLIN;
+	if(flags & POLLER_WRITE) pfd->events |= POLLOUT;
+	poller->keys[poller->count++] = key;
+	Mutex_Unlock(poller->mutex);
+	return true;
+}
+
+cs_bool Poller_Remove(Poller *poller, Socket sock) {
+	cs_bool found = false;
+	Mutex_Lock(poller->mutex);
+	for(cs_int32 i = 0; i < poller->count; i++) {
+		if(poller->fds[i].fd == sock) {
+			poller->count--;
+			poller->fds[i] = poller->fds[poller->count];
+			poller->keys[i] = poller->keys[poller->count];
+			found = true;
+			break;
+		}
+	}
+	Mutex_Unlock(poller->mutex);
+	return found;
+}
+
+cs_int32 Poller_Wait(Poller *poller, PollEvent *events, cs_int32 timeout) {
+	Mutex_Lock(poller->mutex);
+	cs_int32 count = poller->count;
+	if(count > 0) {
+		Memory_Copy(poller->wfds, poller->fds, count * sizeof(SOCK_POLLFD));
+		Memory_Copy(poller->wkeys, poller->keys, count * sizeof(cs_uint64));
+	}
+	Mutex_Unlock(poller->mutex);
+
+	if(count == 0) {
+		Thread_Sleep(timeout);
+		return 0;
+	}
+
+	if(SOCK_POLL(poller->wfds, count, timeout) <= 0)
+		return 0;
+
+	cs_int32 ready = 0;
+	for(cs_int32 i = 0; i < count && ready < POLLER_MAX_EVENTS; i++) {
+		SOCK_POLLFD *pfd = &poller->wfds[i];
+		if(pfd->revents == 0) continue;
+		events[ready].key = poller->wkeys[i];
+		events[ready].flags = 0;
+		if(pfd->revents & POLLIN) events[ready].flags |= POLLER_READ;
+		if(pfd->revents & POLLOUT) events[ready].flags |= POLLER_WRITE;
+		if(pfd->revents & (POLLHUP | POLLERR))
+			events[ready].flags |= POLLER_HUP | POLLER_READ;
+		ready++;
+	}
+
+	return ready;
+}
+#endif
+
 #if defined(WINDOWS)
 #define ISDIR(h) (h.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
 cs_bool Iter_Init(DirIter *iter, cs_str dir, cs_str ext) {
@@ -365,6 +691,12 @@ cs_bool Directory_SetCurrentDir(cs_str path) {
 cs_bool Directory_Create(cs_str path) {
 	return (cs_bool)CreateDirectoryA(path, NULL);
 }
+
+cs_bool Directory_Sync(cs_str path) {
+	// NTFS сама журналирует переименования
+	(void)path;
+	return true;
+}
 #elif defined(UNIX)
 cs_bool Directory_Exists(cs_str path) {
 	struct stat ss;
@@ -378,6 +710,14 @@ cs_bool Directory_SetCurrentDir(cs_str path) {
 cs_bool Directory_Create(cs_str path) {
 	return mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0;
 }
+
+cs_bool Directory_Sync(cs_str path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	cs_bool succ = fsync(fd) == 0;
+	close(fd);
+	return succ;
+}
 #endif
 
 cs_bool Directory_Ensure(cs_str path) {
@@ -516,6 +856,10 @@ void Mutex_Lock(Mutex *handle) {
 	EnterCriticalSection(handle);
 }
 
+cs_bool Mutex_TryLock(Mutex *handle) {
+	return TryEnterCriticalSection(handle) != 0;
+}
+
 void Mutex_Unlock(Mutex *handle) {
 	LeaveCriticalSection(handle);
 }
@@ -574,6 +918,10 @@ void Mutex_Lock(Mutex *handle) {
 	}
 }
 
+cs_bool Mutex_TryLock(Mutex *handle) {
+	return pthread_mutex_trylock(handle) == 0;
+}
+
 void Mutex_Unlock(Mutex *handle) {
 	cs_int32 ret = pthread_mutex_unlock(handle);
 	if(ret) {
@@ -655,6 +1003,22 @@ cs_uint64 Time_GetMSec() {
 }
 #endif
 
+cs_int32 Atomic_Inc(cs_int32 volatile *ptr) {
+#if defined(WINDOWS)
+	return (cs_int32)InterlockedIncrement((LONG volatile *)ptr);
+#elif defined(UNIX)
+	return __atomic_add_fetch(ptr, 1, __ATOMIC_ACQ_REL);
+#endif
+}
+
+cs_int32 Atomic_Dec(cs_int32 volatile *ptr) {
+#if defined(WINDOWS)
+	return (cs_int32)InterlockedDecrement((LONG volatile *)ptr);
+#elif defined(UNIX)
+	return __atomic_sub_fetch(ptr, 1, __ATOMIC_ACQ_REL);
+#endif
+}
+
 cs_bool Console_BindSignalHandler(TSHND handler) {
 #if defined(WINDOWS)
 	return (cs_bool)SetConsoleCtrlHandler((PHANDLER_ROUTINE)handler, TRUE);
@@ -663,6 +1027,17 @@ cs_bool Console_BindSignalHandler(TSHND handler) {
 #endif
 }
 
+cs_uint32 Process_GetCoreCount(void) {
+#if defined(WINDOWS)
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (cs_uint32)si.dwNumberOfProcessors : 1;
+#elif defined(UNIX)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (cs_uint32)count : 1;
+#endif
+}
+
 void Process_Exit(cs_int32 code) {
 #if defined(WINDOWS)
 	ExitProcess(code);
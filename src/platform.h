@@ -46,6 +46,28 @@ enum {
 	ITER_ERROR
 };
 
+enum {
+	POLLER_READ = BIT(0), // Сокет готов к чтению
+	POLLER_WRITE = BIT(1), // В буфере сокета освободилось место
+	POLLER_HUP = BIT(2) // Соединение разорвано
+};
+
+#define POLLER_MAX_EVENTS 64
+
+typedef struct _Poller Poller;
+
+typedef struct _PollEvent {
+	cs_uint64 key;
+	cs_uint32 flags;
+} PollEvent;
+
+#define SOCK_MAX_VEC 16
+
+typedef struct _SockVec {
+	const cs_char *buf;
+	cs_int32 len;
+} SockVec;
+
 typedef struct _DirIter {
 	cs_byte state;
   cs_char fmt[256];
@@ -63,6 +85,7 @@ void Memory_Uninit(void);
 API void *Memory_Alloc(cs_size num, cs_size size);
 API void *Memory_Realloc(void *buf, cs_size old, cs_size new);
 API void  Memory_Copy(void *dst, const void *src, cs_size count);
+API void  Memory_Move(void *dst, const void *src, cs_size count);
 API void  Memory_Fill(void *dst, cs_size count, cs_byte val);
 API void  Memory_Free(void *ptr);
 
@@ -80,12 +103,16 @@ API cs_int32 File_GetChar(cs_file fp);
 API cs_bool File_Error(cs_file fp);
 API cs_bool File_WriteFormat(cs_file fp, cs_str fmt, ...);
 API cs_bool File_Flush(cs_file fp);
+API cs_bool File_Sync(cs_file fp);
 API cs_int32 File_Seek(cs_file fp, long offset, cs_int32 origin);
+API long File_Tell(cs_file fp);
 API cs_bool File_Close(cs_file fp);
 API cs_bool File_ProcClose(cs_file fp);
 
 API cs_bool Directory_Exists(cs_str dir);
 API cs_bool Directory_Create(cs_str dir);
+// Сбрасывает на диск саму директорию, например после переименования файла в ней
+API cs_bool Directory_Sync(cs_str dir);
 API cs_bool Directory_Ensure(cs_str dir);
 API cs_bool Directory_SetCurrentDir(cs_str path);
 
@@ -98,14 +125,26 @@ cs_bool Socket_Init(void);
 API Socket Socket_New(void);
 API cs_int32 Socket_SetAddr(struct sockaddr_in *ssa, cs_str ip, cs_uint16 port);
 API cs_bool Socket_SetAddrGuess(struct sockaddr_in *ssa, cs_str host, cs_uint16 port);
+API cs_bool Socket_SetReusePort(Socket sock);
 API cs_bool Socket_Bind(Socket sock, struct sockaddr_in *ssa);
 API cs_bool Socket_Connect(Socket sock, struct sockaddr_in *ssa);
 API Socket Socket_Accept(Socket sock, struct sockaddr_in *addr);
 API cs_int32 Socket_Receive(Socket sock, cs_char *buf, cs_int32 len, cs_int32 flags);
 API cs_int32 Socket_ReceiveLine(Socket sock, cs_char *line, cs_int32 len);
 API cs_int32 Socket_Send(Socket sock, const cs_char *buf, cs_int32 len);
+API cs_int32 Socket_SendV(Socket sock, SockVec *vec, cs_int32 count);
+API cs_int32 Socket_SendFile(Socket sock, cs_file fp, cs_uint32 offset, cs_int32 len);
+API cs_bool Socket_WaitWrite(Socket sock, cs_int32 timeout);
 API void Socket_Shutdown(Socket sock, cs_int32 how);
 API void Socket_Close(Socket sock);
+API cs_bool Socket_SetNonBlocking(Socket sock, cs_bool state);
+API cs_bool Socket_WouldBlock(void);
+
+API Poller *Poller_Create(void);
+API void Poller_Free(Poller *poller);
+API cs_bool Poller_Add(Poller *poller, Socket sock, cs_uint64 key, cs_uint32 flags);
+API cs_bool Poller_Remove(Poller *poller, Socket sock);
+API cs_int32 Poller_Wait(Poller *poller, PollEvent *events, cs_int32 timeout);
 
 API Thread Thread_Create(TFUNC func, const TARG param, cs_bool detach);
 API cs_bool Thread_IsValid(Thread th);
@@ -116,6 +155,7 @@ API void Thread_Sleep(cs_uint32 ms);
 API Mutex *Mutex_Create(void);
 API void Mutex_Free(Mutex *handle);
 API void Mutex_Lock(Mutex *handle);
+API cs_bool Mutex_TryLock(Mutex *handle);
 API void Mutex_Unlock(Mutex *handle);
 
 API Waitable *Waitable_Create(void);
@@ -124,10 +164,14 @@ API void Waitable_Signal(Waitable *handle);
 API void Waitable_Wait(Waitable *handle);
 API void Waitable_Reset(Waitable *handle);
 
+API cs_int32 Atomic_Inc(cs_int32 volatile *ptr);
+API cs_int32 Atomic_Dec(cs_int32 volatile *ptr);
+
 API void Time_Format(cs_char *buf, cs_size len);
 API cs_uint64 Time_GetMSec(void);
 
 API cs_bool Console_BindSignalHandler(TSHND handler);
 
+API cs_uint32 Process_GetCoreCount(void);
 API void Process_Exit(cs_int32 ecode);
 #endif // PLATFORM_H
@@ -176,13 +176,31 @@ cs_bool Proto_ReadClientPos(Client *client, cs_str data) {
 	PlayerData *cpd = client->playerData;
 	Vec *vec = &cpd->position, newVec;
 	Ang *ang = &cpd->angle, newAng;
-	cs_bool changed = false;
+	cs_bool changed = false,
+	extended = Client_GetExtVer(client, EXT_ENTPOS) != 0;
+
+	/*
+	** Для рассылки позиция сохраняется ещё и в исходном
+	** виде, чтобы не гонять её через float туда и обратно.
+	*/
+	for(cs_int32 i = 0; i < 3; i++) {
+		if(extended)
+			cpd->rawpos[i] = (cs_int32)ntohl(*(cs_int32 *)(data + i * 4));
+		else
+			cpd->rawpos[i] = (cs_int16)ntohs(*(cs_int16 *)(data + i * 2));
+	}
 
-	if(Client_GetExtVer(client, EXT_ENTPOS))
+	if(extended)
 		Proto_ReadFlVec(&data, &newVec);
 	else
 		Proto_ReadFlSVec(&data, &newVec);
 
+	World *world = Client_GetWorld(client);
+	if(world)
+		World_GridSetPos(world, client->id, cpd->rawpos[0] / 32, cpd->rawpos[1] / 32, cpd->rawpos[2] / 32);
+
+	cpd->rawang[0] = (cs_byte)data[0];
+	cpd->rawang[1] = (cs_byte)data[1];
 	Proto_ReadAng(&data, &newAng);
 
 	if(newVec.x != vec->x || newVec.y != vec->y || newVec.z != vec->z) {
@@ -322,14 +340,149 @@ void Vanilla_WriteLvlFin(Client *client, SVec *dims) {
 	PacketWriter_End(client, 7);
 }
 
-void Vanilla_WriteSetBlock(Client *client, SVec *pos, BlockID block) {
-	PacketWriter_Start(client);
-
+/*
+** Энкодеры пакетов, отправляемых сразу нескольким
+** клиентам. Используются как обычными врайтерами,
+** так и функциями, собирающими общий PacketBuf.
+*/
+static cs_uint16 EncodeSetBlock(cs_char *data, SVec *pos, BlockID block) {
 	*data++ = 0x06;
 	Proto_WriteSVec(&data, pos);
-	*data++ = block;
+	*data = block;
+	return 8;
+}
 
-	PacketWriter_End(client, 8);
+static cs_uint16 EncodePosAndOrient(cs_char *data, ClientID id, Client *other, cs_bool extended) {
+	*data++ = 0x08;
+	*data++ = id;
+	return 4 + (cs_uint16)Proto_WriteClientPos(data, other, extended);
+}
+
+static cs_uint16 EncodeChat(cs_char *data, cs_byte type, cs_str mesg, cs_bool cp437) {
+	cs_char mesg_out[64] = {0};
+	String_Copy(mesg_out, 64, mesg);
+
+	if(!cp437) {
+		for(cs_int32 i = 0; i < 64; i++) {
+			if(mesg_out[i] == '\0') break;
+			if(mesg_out[i] < ' ' || mesg_out[i] > '~')
+				mesg_out[i] = '?';
+		}
+	}
+
+	*data++ = 0x0D;
+	*data++ = type;
+	Proto_WriteString(&data, mesg_out);
+	return 66;
+}
+
+static cs_uint16 EncodeAddName(cs_char *data, ClientID id, Client *other) {
+	*data = 0x16; data += 2;
+	*data++ = id;
+	Proto_WriteString(&data, Client_GetName(other));
+	Proto_WriteString(&data, Client_GetName(other));
+	CGroup *group = Client_GetGroup(other);
+	Proto_WriteString(&data, group->name);
+	*data = group->rank;
+	return 196;
+}
+
+static cs_uint16 EncodeAddEntity2(cs_char *data, ClientID id, Client *other, cs_bool extended) {
+	*data++ = 0x21;
+	*data++ = id;
+	if(other->cpeData && other->cpeData->hideDisplayName)
+		Proto_WriteString(&data, NULL);
+	else
+		Proto_WriteString(&data, Client_GetName(other));
+	Proto_WriteString(&data, Client_GetSkin(other));
+	return 132 + (cs_uint16)Proto_WriteClientPos(data, other, extended);
+}
+
+static cs_uint16 EncodeSetModel(cs_char *data, ClientID id, Client *other) {
+	*data++ = 0x1D;
+	*data++ = id;
+	cs_int16 model = Client_GetModel(other);
+	if(model < 256) {
+		cs_char modelname[4];
+		String_FormatBuf(modelname, 4, "%d", model);
+		Proto_WriteString(&data, modelname);
+	} else
+		Proto_WriteString(&data, CPE_GetModelStr(model - 256));
+	return 66;
+}
+
+static cs_uint16 EncodeRemoveName(cs_char *data, ClientID id) {
+	*data++ = 0x18;
+	*data++ = 0;
+	*data = id;
+	return 3;
+}
+
+static cs_uint16 EncodeSetEntityProperty(cs_char *data, ClientID id, cs_int8 type, cs_int32 value) {
+	*data++ = 0x2A;
+	*data++ = id;
+	*data++ = type;
+	*(cs_int32 *)data = htonl(value);
+	return 7;
+}
+
+/*
+** Билдеры собирают пакет для всех клиентов,
+** кроме самого other, один раз. Полученный буфер
+** рассылается через Client_SendBuf и освобождается
+** вызовом PacketBuf_Release.
+*/
+PacketBuf *Vanilla_BuildSetBlock(SVec *pos, BlockID block) {
+	PacketBuf *buf = PacketBuf_Create(8);
+	buf->len = EncodeSetBlock(buf->data, pos, block);
+	return buf;
+}
+
+PacketBuf *Vanilla_BuildPosAndOrient(Client *other, cs_bool extended) {
+	PacketBuf *buf = PacketBuf_Create(16);
+	buf->len = EncodePosAndOrient(buf->data, other->id, other, extended);
+	return buf;
+}
+
+PacketBuf *Vanilla_BuildChat(cs_byte type, cs_str mesg, cs_bool cp437) {
+	PacketBuf *buf = PacketBuf_Create(66);
+	buf->len = EncodeChat(buf->data, type, mesg, cp437);
+	return buf;
+}
+
+PacketBuf *CPE_BuildAddName(Client *other) {
+	PacketBuf *buf = PacketBuf_Create(196);
+	buf->len = EncodeAddName(buf->data, other->id, other);
+	return buf;
+}
+
+PacketBuf *CPE_BuildRemoveName(Client *other) {
+	PacketBuf *buf = PacketBuf_Create(3);
+	buf->len = EncodeRemoveName(buf->data, other->id);
+	return buf;
+}
+
+PacketBuf *CPE_BuildAddEntity2(Client *other, cs_bool extended) {
+	PacketBuf *buf = PacketBuf_Create(144);
+	buf->len = EncodeAddEntity2(buf->data, other->id, other, extended);
+	return buf;
+}
+
+PacketBuf *CPE_BuildSetModel(Client *other) {
+	PacketBuf *buf = PacketBuf_Create(66);
+	buf->len = EncodeSetModel(buf->data, other->id, other);
+	return buf;
+}
+
+PacketBuf *CPE_BuildSetEntityProperty(Client *other, cs_int8 type, cs_int32 value) {
+	PacketBuf *buf = PacketBuf_Create(7);
+	buf->len = EncodeSetEntityProperty(buf->data, other->id, type, value);
+	return buf;
+}
+
+void Vanilla_WriteSetBlock(Client *client, SVec *pos, BlockID block) {
+	PacketWriter_Start(client);
+	PacketWriter_End(client, EncodeSetBlock(data, pos, block));
 }
 
 void Vanilla_WriteSpawn(Client *client, Client *other) {
@@ -358,12 +511,19 @@ void Vanilla_WriteTeleport(Client *client, Vec *pos, Ang *ang) {
 void Vanilla_WritePosAndOrient(Client *client, Client *other) {
 	PacketWriter_Start(client);
 
-	*data++ = 0x08;
-	*data++ = client == other ? CLIENT_SELF : other->id;
 	cs_bool extended = Client_GetExtVer(client, EXT_ENTPOS) != 0;
-	cs_uint32 len = Proto_WriteClientPos(data, other, extended);
-
-	PacketWriter_End(client, 4 + len);
+	cs_uint16 len = EncodePosAndOrient(data, client == other ? CLIENT_SELF : other->id, other, extended);
+
+	/*
+	** Позиция другого игрока всё равно устареет
+	** со следующим пакетом, поэтому при переполнении
+	** очереди такие пакеты можно пропустить.
+	*/
+	if(client != other) {
+		PacketWriter_EndDroppable(client, len);
+	} else {
+		PacketWriter_End(client, len);
+	}
 }
 
 void Vanilla_WriteDespawn(Client *client, Client *other) {
@@ -376,32 +536,27 @@ void Vanilla_WriteDespawn(Client *client, Client *other) {
 }
 
 void Vanilla_WriteChat(Client *client, cs_byte type, cs_str mesg) {
-	PacketWriter_Start(client);
 	if(client == Broadcast) {
+		/*
+		** Сообщение собирается не более двух раз:
+		** для клиентов с поддержкой CP437 и без неё.
+		*/
+		PacketBuf *bufs[2] = {NULL, NULL};
 		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
 			Client *tg = Clients_List[i];
-			if(tg) Vanilla_WriteChat(tg, type, mesg);
+			if(!tg) continue;
+			cs_bool cp437 = Client_GetExtVer(tg, EXT_CP437) != 0;
+			if(!bufs[cp437]) bufs[cp437] = Vanilla_BuildChat(type, mesg, cp437);
+			Client_SendBuf(tg, bufs[cp437], SEND_NORMAL);
 		}
-		PacketWriter_Stop(client);
+		if(bufs[0]) PacketBuf_Release(bufs[0]);
+		if(bufs[1]) PacketBuf_Release(bufs[1]);
 		return;
 	}
 
-	cs_char mesg_out[64] = {0};
-	String_Copy(mesg_out, 64, mesg);
-
-	if(!Client_GetExtVer(client, EXT_CP437)) {
-		for(cs_int32 i = 0; i < 64; i++) {
-			if(mesg_out[i] == '\0') break;
-			if(mesg_out[i] < ' ' || mesg_out[i] > '~')
-				mesg_out[i] = '?';
-		}
-	}
-
-	*data++ = 0x0D;
-	*data++ = type;
-	Proto_WriteString(&data, mesg_out);
-
-	PacketWriter_End(client, 66);
+	PacketWriter_Start(client);
+	cs_bool cp437 = Client_GetExtVer(client, EXT_CP437) != 0;
+	PacketWriter_End(client, EncodeChat(data, type, mesg, cp437));
 }
 
 void Vanilla_WriteKick(Client *client, cs_str reason) {
@@ -465,14 +620,6 @@ cs_bool Handler_Handshake(Client *client, cs_str data) {
 	return true;
 }
 
-static void UpdateBlock(World *world, SVec *pos, BlockID block) {
-	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
-		Client *client = Clients_List[i];
-		if(client && Client_IsInGame(client) && Client_IsInWorld(client, world))
-			Vanilla_WriteSetBlock(client, pos, block);
-	}
-}
-
 cs_bool Handler_SetBlock(Client *client, cs_str data) {
 	ValidateClientState(client, STATE_INGAME, false)
 
@@ -491,16 +638,16 @@ cs_bool Handler_SetBlock(Client *client, cs_str data) {
 				return false;
 			}
 			if(Event_OnBlockPlace(client, mode, &pos, &block)) {
-				World_SetBlock(world, &pos, block);
-				UpdateBlock(world, &pos, block);
+				if(World_SetBlock(world, &pos, block))
+					World_QueueBlockUpdate(world, World_GetOffset(world, &pos), block);
 			} else
 				Vanilla_WriteSetBlock(client, &pos, World_GetBlock(world, &pos));
 			break;
 		case 0x00:
 			block = BLOCK_AIR;
 			if(Event_OnBlockPlace(client, mode, &pos, &block)) {
-				World_SetBlock(world, &pos, block);
-				UpdateBlock(world, &pos, block);
+				if(World_SetBlock(world, &pos, block))
+					World_QueueBlockUpdate(world, World_GetOffset(world, &pos), block);
 			} else
 				Vanilla_WriteSetBlock(client, &pos, World_GetBlock(world, &pos));
 			break;
@@ -520,14 +667,180 @@ cs_bool Handler_PosAndOrient(Client *client, cs_str data) {
 		cpd->heldBlock = cb;
 	}
 
-	if(Proto_ReadClientPos(client, data)) {
-		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
-			Client *other = Clients_List[i];
-			if(other && client != other && Client_IsInGame(other) && Client_IsInSameWorld(client, other))
-				Vanilla_WritePosAndOrient(other, client);
+	if(Proto_ReadClientPos(client, data))
+		client->playerData->moved = true;
+	return true;
+}
+
+/*
+** Рассылка позиций игроков. Хендлер только помечает
+** игрока как сдвинувшегося, а здесь раз в тик каждому
+** получателю одним куском отправляются последние
+** позиции всех сдвинувшихся игроков его мира.
+*/
+/*
+** Если смещение игрока с прошлой рассылки умещается
+** в байт, вместо телепорта отправляется один из
+** относительных пакетов 0x09, 0x0A или 0x0B. Базой
+** для них служит sentpos, поэтому получатель, которому
+** позиция игрока приходила в обход рассылки (спавн,
+** смена скина) или у которого пакет был выброшен,
+** помечается в absmask и получает телепорт.
+*/
+static struct _MoveRecord {
+	Client *client;
+	World *world;
+	cs_bool absolute; // Смещение не умещается в относительный пакет
+	cs_uint16 len[3]; // Телепорт, телепорт [ExtEntityPositions], относительный пакет
+	cs_char data[3][16];
+} Moves[MAX_CLIENTS];
+
+static cs_uint64 RelaySent = 0, RelaySaved = 0;
+
+static cs_uint16 EncodeTeleport(cs_char *data, ClientID id, cs_int32 *pos, cs_byte *ang, cs_bool extended) {
+	*data++ = 0x08;
+	*data++ = id;
+	for(cs_int32 i = 0; i < 3; i++) {
+		if(extended) {
+			*(cs_int32 *)data = htonl(pos[i]); data += 4;
+		} else {
+			*(cs_int16 *)data = htons((cs_int16)pos[i]); data += 2;
 		}
 	}
-	return true;
+	*data++ = ang[0];
+	*data++ = ang[1];
+	return extended ? 16 : 10;
+}
+
+static cs_uint16 EncodeRelative(cs_char *data, ClientID id, cs_int32 *delta, cs_byte *ang, cs_bool moved, cs_bool rotated) {
+	*data++ = moved ? (rotated ? 0x09 : 0x0A) : 0x0B;
+	*data++ = id;
+	if(moved) {
+		*data++ = (cs_char)delta[0];
+		*data++ = (cs_char)delta[1];
+		*data++ = (cs_char)delta[2];
+	}
+	if(rotated) {
+		*data++ = ang[0];
+		*data++ = ang[1];
+	}
+	return 2 + (moved ? 3 : 0) + (rotated ? 2 : 0);
+}
+
+void Proto_ResetRelay(Client *client, Client *other) {
+	if(client != other && client->playerData && other->id >= 0)
+		ClientMask_Set(client->playerData->absmask, other->id);
+}
+
+void Proto_GetRelayStats(cs_uint64 *sent, cs_uint64 *saved) {
+	*sent = RelaySent;
+	*saved = RelaySaved;
+}
+
+void Proto_RelayPositions(void) {
+	cs_int32 count = 0;
+
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(!client || !Client_IsInGame(client)) continue;
+		PlayerData *pd = client->playerData;
+		if(!pd->moved) continue;
+		pd->moved = false;
+
+		cs_int32 pos[3], delta[3];
+		cs_byte ang[2] = {pd->rawang[0], pd->rawang[1]};
+		cs_bool moved = false, absolute = false,
+		rotated = ang[0] != pd->sentang[0] || ang[1] != pd->sentang[1];
+		for(cs_int32 j = 0; j < 3; j++) {
+			pos[j] = pd->rawpos[j];
+			delta[j] = pos[j] - pd->sentpos[j];
+			if(delta[j] != 0) moved = true;
+			if(delta[j] < -128 || delta[j] > 127) absolute = true;
+		}
+		if(!moved && !rotated) continue;
+
+		struct _MoveRecord *mr = &Moves[count++];
+		mr->client = client;
+		mr->world = Client_GetWorld(client);
+		mr->absolute = absolute;
+		mr->len[0] = EncodeTeleport(mr->data[0], client->id, pos, ang, false);
+		mr->len[1] = EncodeTeleport(mr->data[1], client->id, pos, ang, true);
+		if(!absolute)
+			mr->len[2] = EncodeRelative(mr->data[2], client->id, delta, ang, moved, rotated);
+		Memory_Copy(pd->sentpos, pos, sizeof(pos));
+		Memory_Copy(pd->sentang, ang, sizeof(ang));
+	}
+	/*
+	** Получателю, которому регулятор частоты запретил
+	** обновления на этом тике, перемещения не шлются,
+	** а сдвинувшиеся игроки помечаются в stale. Когда
+	** обновления снова разрешатся, он получит телепорт
+	** на их последнюю разосланную позицию.
+	*/
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(!client || client->closed || !Client_IsInGame(client)) continue;
+		PlayerData *pd = client->playerData;
+		World *world = Client_GetWorld(client);
+
+		if(!client->rate.due) {
+			for(cs_int32 j = 0; j < count; j++) {
+				struct _MoveRecord *mr = &Moves[j];
+				if(mr->client != client && mr->world == world)
+					ClientMask_Set(pd->stale, mr->client->id);
+			}
+			continue;
+		}
+
+		cs_bool extended = Client_GetExtVer(client, EXT_ENTPOS) != 0;
+		cs_byte sent[CLIENTMASK_SIZE] = {0};
+		cs_uint32 saved = 0;
+
+		Mutex_Lock(client->mutex);
+		cs_char *data = client->wrbuf;
+		for(cs_int32 j = 0; j < count; j++) {
+			struct _MoveRecord *mr = &Moves[j];
+			if(mr->client == client || mr->world != world ||
+			!Client_IsVisible(client, mr->client)) continue;
+
+			ClientID id = mr->client->id;
+			cs_int32 type = extended;
+			if(!mr->absolute && !ClientMask_Test(pd->absmask, id) && !ClientMask_Test(pd->stale, id)) {
+				saved += mr->len[extended] - mr->len[2];
+				type = 2;
+			}
+			ClientMask_Clear(pd->absmask, id);
+			ClientMask_Clear(pd->stale, id);
+			ClientMask_Set(sent, id);
+			Memory_Copy(data, mr->data[type], mr->len[type]);
+			data += mr->len[type];
+		}
+
+		for(ClientID j = 0; j < MAX_CLIENTS; j++) {
+			if(!ClientMask_Test(pd->stale, j)) continue;
+			ClientMask_Clear(pd->stale, j);
+			Client *other = Clients_List[j];
+			if(!other || other == client || !Client_IsInGame(other) ||
+			!Client_IsInWorld(other, world) || !Client_IsVisible(client, other)) continue;
+
+			PlayerData *opd = other->playerData;
+			ClientMask_Clear(pd->absmask, j);
+			ClientMask_Set(sent, j);
+			data += EncodeTeleport(data, j, opd->sentpos, opd->sentang, extended);
+		}
+
+		cs_int32 len = (cs_int32)(data - client->wrbuf);
+		if(len > 0) {
+			if(Client_Send(client, len, SEND_DROPPABLE)) {
+				RelaySent += len;
+				RelaySaved += saved;
+			} else {
+				for(cs_int32 j = 0; j < CLIENTMASK_SIZE; j++)
+					pd->stale[j] |= sent[j];
+			}
+		}
+		Mutex_Unlock(client->mutex);
+	}
 }
 
 cs_bool Handler_Message(Client *client, cs_str data) {
@@ -677,41 +990,21 @@ void CPE_WriteSetHotKey(Client *client, cs_str action, cs_int32 keycode, cs_int8
 
 void CPE_WriteAddName(Client *client, Client *other) {
 	PacketWriter_Start(client);
-
-	*data = 0x16; data += 2;
-	*data++ = client == other ? CLIENT_SELF : other->id;
-	Proto_WriteString(&data, Client_GetName(other));
-	Proto_WriteString(&data, Client_GetName(other));
-	CGroup *group = Client_GetGroup(other);
-	Proto_WriteString(&data, group->name);
-	*data = group->rank;
-
-	PacketWriter_End(client, 196);
+	ClientID id = client == other ? CLIENT_SELF : other->id;
+	PacketWriter_End(client, EncodeAddName(data, id, other));
 }
 
 void CPE_WriteAddEntity2(Client *client, Client *other) {
 	PacketWriter_Start(client);
-
-	*data++ = 0x21;
-	*data++ = client == other ? CLIENT_SELF : other->id;
-	if(other->cpeData && other->cpeData->hideDisplayName)
-		Proto_WriteString(&data, NULL);
-	else
-		Proto_WriteString(&data, Client_GetName(other));
-	Proto_WriteString(&data, Client_GetSkin(other));
+	ClientID id = client == other ? CLIENT_SELF : other->id;
 	cs_bool extended = Client_GetExtVer(client, EXT_ENTPOS) != 0;
-	cs_uint32 len = Proto_WriteClientPos(data, other, extended);
-
-	PacketWriter_End(client, 132 + len);
+	PacketWriter_End(client, EncodeAddEntity2(data, id, other, extended));
 }
 
 void CPE_WriteRemoveName(Client *client, Client *other) {
 	PacketWriter_Start(client);
-
-	*data = 0x18; data += 2;
-	*data = client == other ? CLIENT_SELF : other->id;
-
-	PacketWriter_End(client, 3);
+	ClientID id = client == other ? CLIENT_SELF : other->id;
+	PacketWriter_End(client, EncodeRemoveName(data, id));
 }
 
 void CPE_WriteEnvColor(Client *client, cs_byte type, Color3* col) {
@@ -759,18 +1052,8 @@ void CPE_WriteBlockPerm(Client *client, BlockID id, cs_bool allowPlace, cs_bool
 
 void CPE_WriteSetModel(Client *client, Client *other) {
 	PacketWriter_Start(client);
-
-	*data++ = 0x1D;
-	*data++ = client == other ? CLIENT_SELF : other->id;
-	cs_int16 model = Client_GetModel(other);
-	if(model < 256) {
-		cs_char modelname[4];
-		String_FormatBuf(modelname, 4, "%d", model);
-		Proto_WriteString(&data, modelname);
-	} else
-		Proto_WriteString(&data, CPE_GetModelStr(model - 256));
-
-	PacketWriter_End(client, 66);
+	ClientID id = client == other ? CLIENT_SELF : other->id;
+	PacketWriter_End(client, EncodeSetModel(data, id, other));
 }
 
 void CPE_WriteWeatherType(Client *client, cs_int8 type) {
@@ -827,13 +1110,24 @@ void CPE_WriteDefineExBlock(Client *client, BlockDef *block) {
 	PacketWriter_End(client, 88);
 }
 
-void CPE_WriteBulkBlockUpdate(Client *client, BulkBlockUpdate *bbu) {
-	PacketWriter_Start(client);
-
+// В пакете передаётся количество блоков минус один
+static cs_uint32 EncodeBulkBlockUpdate(cs_char *data, BulkBlockUpdate *bbu) {
 	*data++ = 0x26;
 	*(struct _BBUData *)data = bbu->data;
+	*data = (cs_char)(bbu->data.count - 1);
+	return 1282;
+}
 
-	PacketWriter_End(client, 1282);
+void CPE_WriteBulkBlockUpdate(Client *client, BulkBlockUpdate *bbu) {
+	if(bbu->data.count == 0) return;
+	PacketWriter_Start(client);
+	PacketWriter_End(client, EncodeBulkBlockUpdate(data, bbu));
+}
+
+PacketBuf *CPE_BuildBulkBlockUpdate(BulkBlockUpdate *bbu) {
+	PacketBuf *buf = PacketBuf_Create(1282);
+	buf->len = EncodeBulkBlockUpdate(buf->data, bbu);
+	return buf;
 }
 
 void CPE_WriteSetTextColor(Client *client, Color4* color, cs_char code) {
@@ -867,13 +1161,8 @@ void CPE_WriteMapProperty(Client *client, cs_byte property, cs_int32 value) {
 
 void CPE_WriteSetEntityProperty(Client *client, Client *other, cs_int8 type, cs_int32 value) {
 	PacketWriter_Start(client);
-
-	*data++ = 0x2A;
-	*data++ = client == other ? CLIENT_SELF : other->id;
-	*data++ = type;
-	*(cs_int32 *)data = htonl(value);
-
-	PacketWriter_End(client, 7);
+	ClientID id = client == other ? CLIENT_SELF : other->id;
+	PacketWriter_End(client, EncodeSetEntityProperty(data, id, type, value));
 }
 
 void CPE_WriteTwoWayPing(Client *client, cs_byte direction, cs_int16 num) {
@@ -1037,7 +1326,7 @@ cs_bool CPEHandler_TwoWayPing(Client *client, cs_str data) {
 	if(pingDirection == 0) {
 		CPE_WriteTwoWayPing(client, 0, pingData);
 		if(!cpd->pingStarted) {
-			CPE_WriteTwoWayPing(client, 1, cpd->pingData++);
+			CPE_WriteTwoWayPing(client, 1, ++cpd->pingData);
 			cpd->pingStarted = true;
 			cpd->pingStart = Time_GetMSec();
 		}
@@ -15,7 +15,11 @@ cs_char *data = client->wrbuf; \
 Mutex_Lock(client->mutex);
 
 #define PacketWriter_End(client, size) \
-Client_Send(client, size); \
+Client_Send(client, size, SEND_NORMAL); \
+Mutex_Unlock(client->mutex);
+
+#define PacketWriter_EndDroppable(client, size) \
+Client_Send(client, size, SEND_DROPPABLE); \
 Mutex_Unlock(client->mutex);
 
 #define PacketWriter_Stop(client) \
@@ -102,6 +106,16 @@ void Packet_RegisterDefault(void);
 ** ванильного протокола
 */
 
+PacketBuf *Vanilla_BuildSetBlock(SVec *pos, BlockID block);
+PacketBuf *Vanilla_BuildPosAndOrient(Client *other, cs_bool extended);
+PacketBuf *Vanilla_BuildChat(cs_byte type, cs_str mesg, cs_bool cp437);
+PacketBuf *CPE_BuildAddName(Client *other);
+PacketBuf *CPE_BuildRemoveName(Client *other);
+PacketBuf *CPE_BuildAddEntity2(Client *other, cs_bool extended);
+PacketBuf *CPE_BuildSetModel(Client *other);
+PacketBuf *CPE_BuildSetEntityProperty(Client *other, cs_int8 type, cs_int32 value);
+PacketBuf *CPE_BuildBulkBlockUpdate(BulkBlockUpdate *bbu);
+
 void Vanilla_WriteHandshake(Client *client, cs_str name, cs_str motd);
 void Vanilla_WriteLvlInit(Client *client, cs_uint32 size);
 void Vanilla_WriteLvlFin(Client *client, SVec *dims);
@@ -116,6 +130,9 @@ void Vanilla_WriteKick(Client *client, cs_str reason);
 cs_bool Handler_Handshake(Client *client, cs_str data);
 cs_bool Handler_SetBlock(Client *client, cs_str data);
 cs_bool Handler_PosAndOrient(Client *client, cs_str data);
+void Proto_RelayPositions(void);
+void Proto_ResetRelay(Client *client, Client *other);
+API void Proto_GetRelayStats(cs_uint64 *sent, cs_uint64 *saved);
 cs_bool Handler_Message(Client *client, cs_str data);
 
 /*
@@ -0,0 +1,301 @@
+#include "core.h"
+#include "platform.h"
+#include "server.h"
+#include "client.h"
+#include "protocol.h"
+#include "config.h"
+#include "lang.h"
+#include "reactor.h"
+
+/*
+** Ключ события состоит из индекса слота клиента
+** и поколения этого слота. Если слот успели освободить
+** и занять заново, события, полученные для старого
+** клиента, будут отброшены.
+*/
+#define LISTENER_KEY ((cs_uint64)-1)
+#define MAKE_KEY(slot, gen) (((cs_uint64)(gen) << 32) | (slot))
+
+static Reactor *Reactors_List[REACTOR_MAX_COUNT] = {0};
+static Mutex *ReactorsMutex = NULL; // Реакторы освобождаются, пока плагины читают их нагрузку
+static Mutex *PendingMutex = NULL;
+static cs_uint32 PendingAddrs[REACTOR_MAX_PENDING]; // Адреса подключений на стадии определения типа и рукопожатия
+static cs_uint32 PendingCount = 0;
+
+/*
+** Подключения, ещё не попавшие в Clients_List, тоже
+** занимают сокет и память, поэтому учитываются в лимите
+** на адрес, а их общее число по всем реакторам
+** ограничено REACTOR_MAX_PENDING.
+*/
+static cs_str AddPending(Reactor *reactor, Client *client) {
+	cs_int32 maxConnPerIP = Config_GetInt8ByKey(Server_Config, CFG_CONN_KEY),
+	sameAddrCount = 1 + Clients_CountAddr(client->addr);
+	cs_str reason = NULL;
+
+	if(sameAddrCount > maxConnPerIP) return Lang_Get(Lang_KickGrp, 10);
+
+	Mutex_Lock(PendingMutex);
+	if(PendingCount >= REACTOR_MAX_PENDING)
+		reason = Lang_Get(Lang_KickGrp, 1);
+	else {
+		for(cs_uint32 i = 0; i < PendingCount && !reason; i++)
+			if(PendingAddrs[i] == client->addr && ++sameAddrCount > maxConnPerIP)
+				reason = Lang_Get(Lang_KickGrp, 10);
+		if(!reason) {
+			PendingAddrs[PendingCount++] = client->addr;
+			reactor->slots[client->rslot].pending = true;
+		}
+	}
+	Mutex_Unlock(PendingMutex);
+
+	return reason;
+}
+
+static void RemovePending(Reactor *reactor, Client *client) {
+	ReactorSlot *rs = &reactor->slots[client->rslot];
+	if(!rs->pending) return;
+	rs->pending = false;
+
+	Mutex_Lock(PendingMutex);
+	for(cs_uint32 i = 0; i < PendingCount; i++) {
+		if(PendingAddrs[i] == client->addr) {
+			PendingAddrs[i] = PendingAddrs[--PendingCount];
+			break;
+		}
+	}
+	Mutex_Unlock(PendingMutex);
+}
+
+static cs_bool AttachClient(Reactor *reactor, Client *client) {
+	cs_uint32 slot = 0;
+	while(slot < reactor->slotsCount && reactor->slots[slot].client) slot++;
+
+	if(slot == reactor->slotsCount) {
+		cs_uint32 newcount = reactor->slotsCount * 2;
+		reactor->slots = Memory_Realloc(reactor->slots,
+			reactor->slotsCount * sizeof(ReactorSlot),
+			newcount * sizeof(ReactorSlot)
+		);
+		reactor->slotsCount = newcount;
+	}
+
+	ReactorSlot *rs = &reactor->slots[slot];
+	if(!Poller_Add(reactor->poller, client->sock, MAKE_KEY(slot, rs->gen), POLLER_READ))
+		return false;
+
+	rs->client = client;
+	client->reactor = reactor;
+	client->rslot = slot;
+	reactor->stats.clients++;
+	return true;
+}
+
+static void DetachClient(Reactor *reactor, Client *client) {
+	ReactorSlot *rs = &reactor->slots[client->rslot];
+	RemovePending(reactor, client);
+	Poller_Remove(reactor->poller, client->sock);
+	rs->client = NULL;
+	rs->gen++;
+	client->reactor = NULL;
+	reactor->stats.clients--;
+}
+
+/*
+** Клиенты, не успевшие попасть в Clients_List,
+** основным потоком не обслуживаются, поэтому
+** их освобождением занимается сам реактор.
+*/
+static void DropClient(Reactor *reactor, Client *client) {
+	DetachClient(reactor, client);
+	Client_Free(client);
+}
+
+static void AcceptClients(Reactor *reactor) {
+	struct sockaddr_in caddr;
+
+	while(reactor->active) {
+		Socket fd = Socket_Accept(reactor->listener, &caddr);
+		if(fd == INVALID_SOCKET) break;
+
+		reactor->stats.accepted++;
+		Client *tmp = Client_New(fd, ntohl(caddr.sin_addr.s_addr));
+		if(!tmp) {
+			Socket_Close(fd);
+			continue;
+		}
+
+		if(!Socket_SetNonBlocking(fd, true) || !AttachClient(reactor, tmp)) {
+			Client_Free(tmp);
+			continue;
+		}
+
+		tmp->nettimeout = Time_GetMSec() + REACTOR_SNIFF_TIMEOUT;
+		cs_str reason = AddPending(reactor, tmp);
+		if(reason) {
+			Client_Kick(tmp, reason);
+			DropClient(reactor, tmp);
+		}
+	}
+}
+
+static void HandleClient(Reactor *reactor, Client *client, cs_uint32 flags) {
+	Client_Receive(client);
+	/*
+	** Клиент читает сокет, пока не получит меньше, чем
+	** просил. Если в одном событии пришли и данные, и
+	** разрыв соединения, то второго события уже не
+	** будет, поэтому закрываем клиента сразу.
+	*/
+	if(flags & POLLER_HUP) client->closed = true;
+	if(client->id != CLIENT_SELF)
+		RemovePending(reactor, client);
+	else if(client->closed)
+		DropClient(reactor, client);
+}
+
+static void CheckPending(Reactor *reactor) {
+	cs_uint64 now = Time_GetMSec();
+
+	for(cs_uint32 i = 0; i < reactor->slotsCount; i++) {
+		Client *client = reactor->slots[i].client;
+		if(client && client->id == CLIENT_SELF && client->nettimeout < now) {
+			Client_Kick(client, Lang_Get(Lang_KickGrp, 7));
+			DropClient(reactor, client);
+		}
+	}
+}
+
+THREAD_FUNC(ReactorThread) {
+	Reactor *reactor = (Reactor *)param;
+	PollEvent events[POLLER_MAX_EVENTS];
+
+	while(reactor->active) {
+		cs_int32 count = Poller_Wait(reactor->poller, events, REACTOR_WAIT_TIMEOUT);
+		cs_uint64 start = Time_GetMSec();
+		Mutex_Lock(reactor->mutex);
+		if(count > 0) reactor->stats.events += count;
+
+		for(cs_int32 i = 0; i < count; i++) {
+			PollEvent *ev = &events[i];
+			if(ev->key == LISTENER_KEY) {
+				AcceptClients(reactor);
+				continue;
+			}
+
+			cs_uint32 slot = (cs_uint32)ev->key,
+			gen = (cs_uint32)(ev->key >> 32);
+			if(slot >= reactor->slotsCount) continue;
+
+			ReactorSlot *rs = &reactor->slots[slot];
+			if(rs->client && rs->gen == gen)
+				HandleClient(reactor, rs->client, ev->flags);
+		}
+
+		CheckPending(reactor);
+		reactor->stats.busy += Time_GetMSec() - start;
+		Mutex_Unlock(reactor->mutex);
+	}
+
+	return 0;
+}
+
+Reactor *Reactor_Create(Socket listener) {
+	Poller *poller = Poller_Create();
+	if(!poller) return NULL;
+
+	if(!Socket_SetNonBlocking(listener, true) ||
+	!Poller_Add(poller, listener, LISTENER_KEY, POLLER_READ)) {
+		Poller_Free(poller);
+		return NULL;
+	}
+
+	// Общие для всех реакторов и живут до завершения процесса
+	if(!PendingMutex) {
+		PendingMutex = Mutex_Create();
+		ReactorsMutex = Mutex_Create();
+	}
+	Reactor *reactor = Memory_Alloc(1, sizeof(Reactor));
+	reactor->poller = poller;
+	reactor->listener = listener;
+	reactor->mutex = Mutex_Create();
+	reactor->slotsCount = 32;
+	reactor->slots = Memory_Alloc(reactor->slotsCount, sizeof(ReactorSlot));
+	Mutex_Lock(ReactorsMutex);
+	for(cs_int32 i = 0; i < REACTOR_MAX_COUNT; i++) {
+		if(!Reactors_List[i]) {
+			Reactors_List[i] = reactor;
+			break;
+		}
+	}
+	Mutex_Unlock(ReactorsMutex);
+	return reactor;
+}
+
+cs_bool Reactor_Start(Reactor *reactor) {
+	reactor->active = true;
+	reactor->thread = Thread_Create(ReactorThread, reactor, false);
+	if(!Thread_IsValid(reactor->thread)) {
+		reactor->active = false;
+		return false;
+	}
+	return true;
+}
+
+void Reactor_Stop(Reactor *reactor) {
+	if(!reactor->active) return;
+	reactor->active = false;
+	Thread_Join(reactor->thread);
+
+	/*
+	** Реактор больше не работает, так что клиентов,
+	** уже добавленных в Clients_List, отвязываем от него,
+	** а оставшихся на стадии подключения освобождаем.
+	*/
+	Mutex_Lock(reactor->mutex);
+	for(cs_uint32 i = 0; i < reactor->slotsCount; i++) {
+		Client *client = reactor->slots[i].client;
+		if(!client) continue;
+		if(client->id == CLIENT_SELF)
+			DropClient(reactor, client);
+		else
+			DetachClient(reactor, client);
+	}
+	Mutex_Unlock(reactor->mutex);
+}
+
+void Reactor_Free(Reactor *reactor) {
+	Reactor_Stop(reactor);
+	Mutex_Lock(ReactorsMutex);
+	for(cs_int32 i = 0; i < REACTOR_MAX_COUNT; i++)
+		if(Reactors_List[i] == reactor) Reactors_List[i] = NULL;
+	Mutex_Unlock(ReactorsMutex);
+	Poller_Free(reactor->poller);
+	Mutex_Free(reactor->mutex);
+	Memory_Free(reactor->slots);
+	Memory_Free(reactor);
+}
+
+void Reactor_Remove(Client *client) {
+	Reactor *reactor = client->reactor;
+	Mutex_Lock(reactor->mutex);
+	DetachClient(reactor, client);
+	Mutex_Unlock(reactor->mutex);
+}
+
+cs_int32 Reactor_GetStats(ReactorStats *stats, cs_int32 max) {
+	cs_int32 count = 0;
+	if(!ReactorsMutex) return 0;
+
+	Mutex_Lock(ReactorsMutex);
+	for(cs_int32 i = 0; i < REACTOR_MAX_COUNT && count < max; i++) {
+		Reactor *reactor = Reactors_List[i];
+		if(!reactor || !reactor->active) continue;
+		Mutex_Lock(reactor->mutex);
+		stats[count++] = reactor->stats;
+		Mutex_Unlock(reactor->mutex);
+	}
+	Mutex_Unlock(ReactorsMutex);
+
+	return count;
+}
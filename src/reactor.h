@@ -0,0 +1,46 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+#include "client.h"
+
+#define REACTOR_WAIT_TIMEOUT 100 // Максимальное время ожидания событий, в миллисекундах
+#define REACTOR_SNIFF_TIMEOUT 500 // Время на определение типа подключения
+#define REACTOR_HANDSHAKE_TIMEOUT 5000 // Время на WebSocket рукопожатие
+#define REACTOR_MAX_COUNT 64 // Наибольшее количество реакторов
+#define REACTOR_MAX_PENDING 256 // Наибольшее количество подключений, ещё не попавших в Clients_List
+
+typedef struct _ReactorSlot {
+	Client *client; // NULL, если слот свободен
+	cs_uint32 gen; // Увеличивается при каждом освобождении слота
+	cs_bool pending; // Адрес клиента учтён в списке ожидающих подключений
+} ReactorSlot;
+
+typedef struct _ReactorStats {
+	cs_uint32 clients; // Сколько клиентов сейчас обслуживает реактор
+	cs_uint64 accepted, // Сколько подключений реактор принял за всё время
+	events, // Сколько событий сокетов он обработал
+	busy; // Сколько миллисекунд он потратил на их обработку
+} ReactorStats;
+
+typedef struct _Reactor {
+	Poller *poller; // Сокеты всех клиентов реактора и слушающий сокет
+	Socket listener; // Слушающий сокет сервера
+	Mutex *mutex; // Лочится на время обработки событий
+	Thread thread; // Поток, в котором крутится цикл реактора
+	ReactorSlot *slots; // Таблица клиентов, индекс слота входит в ключ события
+	cs_uint32 slotsCount; // Размер таблицы клиентов
+	cs_bool active; // Цикл реактора работает, пока это значение true
+	ReactorStats stats; // Нагрузка на реактор, меняется под его мьютексом
+} Reactor;
+
+Reactor *Reactor_Create(Socket listener);
+cs_bool Reactor_Start(Reactor *reactor);
+void Reactor_Stop(Reactor *reactor);
+void Reactor_Free(Reactor *reactor);
+void Reactor_Remove(Client *client);
+/*
+** Копирует в stats нагрузку не более чем max
+** работающих реакторов. Возвращает количество
+** скопированных записей.
+*/
+API cs_int32 Reactor_GetStats(ReactorStats *stats, cs_int32 max);
+#endif // REACTOR_H
@@ -14,85 +14,34 @@
 #include "lang.h"
 #include "timer.h"
 #include "consoleio.h"
+#include "reactor.h"
 
-THREAD_FUNC(ClientInitThread) {
-	Client *tmp = (Client *)param;
-	cs_int8 maxConnPerIP = Config_GetInt8ByKey(Server_Config, CFG_CONN_KEY),
-	sameAddrCount = 1;
+static Reactor *Server_Reactors[REACTOR_MAX_COUNT] = {0};
+static Socket Server_Listeners[REACTOR_MAX_COUNT];
+static cs_int32 Server_ReactorsCount = 0, Server_ListenersCount = 0;
 
-	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
-		Client *other = Clients_List[i];
-		if(other && other->addr == tmp->addr)
-			++sameAddrCount;
-		else continue;
-
-		if(sameAddrCount > maxConnPerIP) {
-			Client_Kick(tmp, Lang_Get(Lang_KickGrp, 10));
-			Client_Free(tmp);
-			return 0;
-		}
-	}
-
-	cs_byte attempt = 0;
-	while(attempt < 5) {
-		if(Socket_Receive(tmp->sock, tmp->rdbuf, 5, MSG_PEEK) == 5) {
-			if(String_CaselessCompare(tmp->rdbuf, "GET /")) {
-				WebSock *wscl = Memory_Alloc(1, sizeof(WebSock));
-				wscl->proto = "ClassiCube";
-				wscl->recvbuf = tmp->rdbuf;
-				wscl->sock = tmp->sock;
-				tmp->websock = wscl;
-				if(WebSock_DoHandshake(wscl))
-					goto client_ok;
-				else break;
-			} else goto client_ok;
-		}
-		Thread_Sleep(100);
-		attempt++;
+static Socket Listen(struct sockaddr_in *ssa, cs_bool reuse) {
+	Socket sock = Socket_New();
+	if(!sock) {
+		Error_PrintSys(true);
 	}
-
-	Client_Kick(tmp, Lang_Get(Lang_KickGrp, 7));
-	Client_Free(tmp);
-	return 0;
-
-	client_ok:
-	if(!Client_Add(tmp)) {
-		Client_Kick(tmp, Lang_Get(Lang_KickGrp, 1));
-		Client_Free(tmp);
+	if(reuse && !Socket_SetReusePort(sock)) {
+		Socket_Close(sock);
+		return INVALID_SOCKET;
 	}
-
-	return 0;
-}
-
-THREAD_FUNC(AcceptThread) {
-	(void)param;
-	struct sockaddr_in caddr;
-
-	while(Server_Active) {
-		Socket fd = Socket_Accept(Server_Socket, &caddr);
-
-		if(fd != INVALID_SOCKET) {
-			if(!Server_Active) {
-				Socket_Close(fd);
-				break;
-			}
-
-			Client *tmp = Client_New(fd, ntohl(caddr.sin_addr.s_addr));
-			if(tmp)
-				Thread_Create(ClientInitThread, tmp, true);
-			else
-				Socket_Close(fd);
-		}
+	if(!Socket_Bind(sock, ssa)) {
+		Error_PrintSys(true);
 	}
-
-	return 0;
+	return sock;
 }
 
+/*
+** Каждый реактор получает свой слушающий сокет,
+** так что ядро само раскидывает подключения по
+** ним. Если система так не умеет, все реакторы
+** слушают один общий сокет.
+*/
 static void Bind(cs_str ip, cs_uint16 port) {
-	Server_Socket = Socket_New();
-	if(!Server_Socket) {
-		Error_PrintSys(true);
-	}
 	struct sockaddr_in ssa;
 	switch (Socket_SetAddr(&ssa, ip, port)) {
 		case 0:
@@ -105,8 +54,50 @@ static void Bind(cs_str ip, cs_uint16 port) {
 
 	Client_Init();
 	Log_Info(Lang_Get(Lang_ConGrp, 0), ip, port);
-	if(!Socket_Bind(Server_Socket, &ssa)) {
-		Error_PrintSys(true);
+	Server_ReactorsCount = Config_GetInt8ByKey(Server_Config, CFG_REACTORS_KEY);
+	Server_Socket = INVALID_SOCKET;
+	if(Server_ReactorsCount > 1)
+		Server_Socket = Listen(&ssa, true);
+	if(Server_Socket == INVALID_SOCKET) {
+		Server_Socket = Listen(&ssa, false);
+		Server_Listeners[Server_ListenersCount++] = Server_Socket;
+		return;
+	}
+
+	Server_Listeners[Server_ListenersCount++] = Server_Socket;
+	while(Server_ListenersCount < Server_ReactorsCount) {
+		Socket sock = Listen(&ssa, true);
+		if(sock == INVALID_SOCKET) {
+			Error_PrintSys(true);
+		}
+		Server_Listeners[Server_ListenersCount++] = sock;
+	}
+}
+
+TIMER_FUNC(StatsTimer) {
+	(void)ticks; (void)left; (void)ud;
+	cs_uint64 sent, saved;
+	Proto_GetRelayStats(&sent, &saved);
+	Log_Debug(Lang_Get(Lang_DbgGrp, 3), (cs_int32)(sent / 1024), (cs_int32)(saved / 1024));
+
+	cs_int32 players = 0, throttled = 0;
+	cs_uint32 slowest = 0;
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(!client || !Client_IsInGame(client)) continue;
+		cs_uint32 interval = Client_GetUpdateInterval(client);
+		if(interval > 0) throttled++;
+		slowest = max(slowest, interval);
+		players++;
+	}
+	Log_Debug(Lang_Get(Lang_DbgGrp, 4), throttled, players, (cs_int32)slowest);
+
+	ReactorStats stats[REACTOR_MAX_COUNT];
+	cs_int32 count = Reactor_GetStats(stats, REACTOR_MAX_COUNT);
+	for(cs_int32 i = 0; i < count; i++) {
+		Log_Debug(Lang_Get(Lang_DbgGrp, 5), i, (cs_int32)stats[i].clients,
+			(cs_int32)stats[i].accepted, (cs_int32)stats[i].events, (cs_int32)stats[i].busy
+		);
 	}
 }
 
@@ -153,6 +144,11 @@ cs_bool Server_Init(void) {
 	Config_SetLimit(ent, 1, 5);
 	Config_SetDefaultInt8(ent, 5);
 
+	ent = Config_NewEntry(cfg, CFG_REACTORS_KEY, CFG_TINT8);
+	Config_SetComment(ent, "Number of threads that accept connections and read packets from clients, each client stays on one of them. [1-64]");
+	Config_SetLimit(ent, 1, REACTOR_MAX_COUNT);
+	Config_SetDefaultInt8(ent, 1);
+
 	ent = Config_NewEntry(cfg, CFG_HEARTBEAT_KEY, CFG_TBOOL);
 	Config_SetComment(ent, "Enable ClassiCube heartbeat.");
 	Config_SetDefaultBool(ent, false);
@@ -166,12 +162,80 @@ cs_bool Server_Init(void) {
 	Config_SetComment(ent, "Show server in the ClassiCube server list.");
 	Config_SetDefaultBool(ent, false);
 
+	ent = Config_NewEntry(cfg, CFG_QUEUESIZE_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Outbound packet queue size per client, in kilobytes. [16-16384]");
+	Config_SetLimit(ent, 16, 16384);
+	Config_SetDefaultInt32(ent, 256);
+
+	ent = Config_NewEntry(cfg, CFG_QUEUEPOLICY_KEY, CFG_TSTR);
+	Config_SetComment(ent, "What to do when the client's outbound queue is full. \"drop\" - skip position updates, \"kick\" - disconnect the client.");
+	Config_SetDefaultStr(ent, "drop");
+
+	ent = Config_NewEntry(cfg, CFG_AUTOSAVE_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Save modified worlds every N seconds, 0 - disable autosave. [0-86400]");
+	Config_SetLimit(ent, 0, 86400);
+	Config_SetDefaultInt32(ent, 300);
+
+	ent = Config_NewEntry(cfg, CFG_SAVECONCURRENCY_KEY, CFG_TINT8);
+	Config_SetComment(ent, "Max worlds being saved at the same time. [1-16]");
+	Config_SetLimit(ent, 1, 16);
+	Config_SetDefaultInt8(ent, 2);
+
+	ent = Config_NewEntry(cfg, CFG_SAVERATE_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Autosave disk write limit, in kilobytes per second, 0 - unlimited. [0-1048576]");
+	Config_SetLimit(ent, 0, 1048576);
+	Config_SetDefaultInt32(ent, 0);
+
+	ent = Config_NewEntry(cfg, CFG_VIEWRADIUS_KEY, CFG_TINT16);
+	Config_SetComment(ent, "Players farther than N blocks from each other are not spawned, 0 - whole world. [0-4096]");
+	Config_SetLimit(ent, 0, 4096);
+	Config_SetDefaultInt16(ent, 0);
+
+	ent = Config_NewEntry(cfg, CFG_MAXTRANSFERS_KEY, CFG_TINT8);
+	Config_SetComment(ent, "Max maps being sent to joining players at the same time, the rest wait in a queue. [1-64]");
+	Config_SetLimit(ent, 1, 64);
+	Config_SetDefaultInt8(ent, 4);
+
+	ent = Config_NewEntry(cfg, CFG_MAPRATE_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Total upload limit for map data, in kilobytes per second, 0 - unlimited. [0-1048576]");
+	Config_SetLimit(ent, 0, 1048576);
+	Config_SetDefaultInt32(ent, 0);
+
+	ent = Config_NewEntry(cfg, CFG_WSDEFLATE_KEY, CFG_TINT8);
+	Config_SetComment(ent, "Compress traffic of browser clients (permessage-deflate) with a 2^N byte window, 0 - disabled. Costs about 2^(N+3) bytes of memory per client. [0-15]");
+	Config_SetLimit(ent, 0, 15);
+	Config_SetDefaultInt8(ent, 12);
+
+	ent = Config_NewEntry(cfg, CFG_MAPSTREAMS_KEY, CFG_TBOOL);
+	Config_SetComment(ent, "Store ready-to-send compressed maps in world files, so unmodified worlds are sent straight from disk.");
+	Config_SetDefaultBool(ent, true);
+
+	ent = Config_NewEntry(cfg, CFG_SECTIONS_KEY, CFG_TBOOL);
+	Config_SetComment(ent, "Store worlds as palette-compressed 16x16x16 sections instead of a flat block array. Saves a lot of memory on mostly empty worlds, but plugins that use World_GetBlockArray won't work.");
+	Config_SetDefaultBool(ent, false);
+
+	ent = Config_NewEntry(cfg, CFG_SLEEPDELAY_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Keep blocks of worlds that had no players for N seconds compressed in memory, 0 - never. [0-86400]");
+	Config_SetLimit(ent, 0, 86400);
+	Config_SetDefaultInt32(ent, 60);
+
+	ent = Config_NewEntry(cfg, CFG_UNLOADDELAY_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Unload worlds that had no players for N seconds, 0 - keep worlds loaded. [0-86400]");
+	Config_SetLimit(ent, 0, 86400);
+	Config_SetDefaultInt32(ent, 600);
+
+	ent = Config_NewEntry(cfg, CFG_WORLDMEMORY_KEY, CFG_TINT32);
+	Config_SetComment(ent, "Unload least recently used empty worlds when loaded worlds take more than N megabytes, 0 - no limit. [0-1048576]");
+	Config_SetLimit(ent, 0, 1048576);
+	Config_SetDefaultInt32(ent, 0);
+
 	cfg->modified = true;
 	if(!Config_Load(cfg)) {
 		Config_PrintError(cfg);
 		return false;
 	}
 	Log_SetLevelStr(Config_GetStrByKey(cfg, CFG_LOGLEVEL_KEY));
+	Worlds_Init();
 
 	Packet_RegisterDefault();
 	Plugin_LoadAll();
@@ -184,7 +248,13 @@ cs_bool Server_Init(void) {
 			if(wIter.isDir || !wIter.cfile) continue;
 			World *tmp = World_Create(wIter.cfile);
 			tmp->id = wIndex++;
-			if(!World_Load(tmp) || !World_Add(tmp))
+			/*
+			** Массивы блоков остальных миров загрузятся,
+			** когда в них кто-нибудь зайдёт, а пока из
+			** файлов читаются только заголовки.
+			*/
+			cs_bool succ = tmp->id == 0 ? World_Load(tmp) : World_LoadInfo(tmp);
+			if(!succ || !World_Add(tmp))
 				World_Free(tmp);
 		} while(Iter_Next(&wIter) && wIndex < MAX_WORLDS);
 	}
@@ -198,6 +268,8 @@ cs_bool Server_Init(void) {
 		if(!Generators_Use(tmp, "flat", NULL))
 			Log_Error("Oh! Error happened in the world generator.");
 		Worlds_List[0] = tmp;
+		World_OpenJournal(tmp);
+		World_WarmCache(tmp);
 	}
 
 	if(Config_GetBoolByKey(cfg, CFG_HEARTBEAT_KEY))
@@ -206,8 +278,15 @@ cs_bool Server_Init(void) {
 	Server_Active = true;
 	cs_str ip = Config_GetStrByKey(cfg, CFG_SERVERIP_KEY);
 	cs_uint16 port = Config_GetInt16ByKey(cfg, CFG_SERVERPORT_KEY);
-	Thread_Create(AcceptThread, NULL, true);
 	Bind(ip, port);
+	for(cs_int32 i = 0; i < Server_ReactorsCount; i++) {
+		Reactor *reactor = Reactor_Create(Server_Listeners[i % Server_ListenersCount]);
+		if(!reactor || !Reactor_Start(reactor)) {
+			Error_PrintSys(true);
+		}
+		Server_Reactors[i] = reactor;
+	}
+	Timer_Add(-1, SERVER_STATS_DELAY, StatsTimer, NULL);
 	Event_Call(EVT_POSTSTART, NULL);
 	ConsoleIO_Init();
 	return true;
@@ -216,6 +295,10 @@ cs_bool Server_Init(void) {
 void Server_DoStep(cs_int32 delta) {
 	Event_Call(EVT_ONTICK, &delta);
 	Timer_Update(delta);
+	Worlds_FlushUpdates();
+	Clients_UpdateVisibility();
+	Proto_RelayPositions();
+	Clients_UpdateTransfers(delta);
 	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
 		Client *client = Clients_List[i];
 		if(client) Client_Tick(client, delta);
@@ -247,10 +330,17 @@ void Server_StartLoop(void) {
 void Server_Stop(void) {
 	Event_Call(EVT_ONSTOP, NULL);
 	Log_Info(Lang_Get(Lang_ConGrp, 4));
+	for(cs_int32 i = 0; i < Server_ReactorsCount; i++)
+		if(Server_Reactors[i]) Reactor_Stop(Server_Reactors[i]);
 	Clients_KickAll(Lang_Get(Lang_KickGrp, 5));
+	Client_Uninit();
 	Log_Info(Lang_Get(Lang_ConGrp, 5));
+	Worlds_Uninit();
 	Worlds_SaveAll(true, true);
-	Socket_Close(Server_Socket);
+	for(cs_int32 i = 0; i < Server_ReactorsCount; i++)
+		if(Server_Reactors[i]) Reactor_Free(Server_Reactors[i]);
+	for(cs_int32 i = 0; i < Server_ListenersCount; i++)
+		Socket_Close(Server_Listeners[i]);
 	Config_Save(Server_Config);
 	Config_DestroyStore(Server_Config);
 	Plugin_UnloadAll();
@@ -10,9 +10,26 @@
 #define CFG_LOCALOP_KEY "always-local-op"
 #define CFG_MAXPLAYERS_KEY "max-players"
 #define CFG_CONN_KEY "max-connections-per-ip"
+#define CFG_REACTORS_KEY "network-threads"
 #define CFG_HEARTBEAT_KEY "heartbeat-enabled"
 #define CFG_HEARTBEATDELAY_KEY "heartbeat-delay"
 #define CFG_HEARTBEAT_PUBLIC_KEY "heartbeat-public"
+#define CFG_QUEUESIZE_KEY "client-queue-size"
+#define CFG_QUEUEPOLICY_KEY "client-queue-overflow"
+#define CFG_AUTOSAVE_KEY "autosave-delay"
+#define CFG_SAVECONCURRENCY_KEY "save-concurrency"
+#define CFG_SAVERATE_KEY "save-rate-limit"
+#define CFG_VIEWRADIUS_KEY "view-radius"
+#define CFG_MAXTRANSFERS_KEY "max-map-transfers"
+#define CFG_MAPRATE_KEY "map-send-rate"
+#define CFG_WSDEFLATE_KEY "websocket-deflate-window"
+#define CFG_MAPSTREAMS_KEY "save-map-streams"
+#define CFG_SECTIONS_KEY "sectioned-worlds"
+#define CFG_SLEEPDELAY_KEY "world-sleep-delay"
+#define CFG_UNLOADDELAY_KEY "world-unload-delay"
+#define CFG_WORLDMEMORY_KEY "world-memory-limit"
+
+#define SERVER_STATS_DELAY 60000 // Как часто нагрузка сервера пишется в отладочный лог, в миллисекундах
 
 VAR cs_bool Server_Active;
 VAR CStore *Server_Config;
@@ -4,149 +4,511 @@
 #include "websocket.h"
 #include "lang.h"
 #include "hash.h"
+#include <zlib.h>
 
-#define WS_RESP "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Protocol: %s\r\nSec-WebSocket-Accept: %s\r\n\r\n"
+#define WS_RESP "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Protocol: %s\r\nSec-WebSocket-Accept: %s\r\n%s\r\n"
 #define WS_ERRRESP "HTTP/1.1 %d %s\r\nConnection: Close\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s"
 
-cs_bool WebSock_DoHandshake(WebSock *ws) {
-	if(!ws->proto) return false;
-	cs_char line[1024], wskey[32], b64[30];
-	cs_byte hash[20];
-	cs_bool validConnection = false;
-	cs_int32 wskeylen = 0, rsplen = 0;
-
-	if(Socket_ReceiveLine(ws->sock, line, 1024)) {
-		cs_str httpver = String_LastChar(line, 'H');
-		if(!httpver || !String_CaselessCompare(httpver, "HTTP/1.1")) {
-			rsplen = String_FormatBuf(line, 1024, WS_ERRRESP, 505, "HTTP Version Not Supported", 0, "");
-			Socket_Send(ws->sock, line, rsplen);
-			return false;
-		}
-	}
+static cs_bool SendHandshakeError(WebSock *ws, cs_int32 code, cs_str status, cs_str body) {
+	cs_char rsp[256];
+	cs_int32 rsplen = String_FormatBuf(rsp, 256, WS_ERRRESP, code, status, String_Length(body), body);
+	Socket_Send(ws->sock, rsp, rsplen);
+	ws->error = WS_ERR_HANDSHAKE;
+	return false;
+}
 
-	while(Socket_ReceiveLine(ws->sock, line, 1024)) {
-		if(*line == '\0') break;
+/*
+** Создаёт контексты сжатия и пишет в ext заголовок
+** с принятыми параметрами расширения. Если zlib не
+** смог выделить память, расширение не включается.
+*/
+static void StartDeflate(WebSock *ws, cs_char *ext, cs_size extlen) {
+	WebSockHS *hs = ws->hs;
+	*ext = '\0';
+	if(!hs->deflate) return;
 
-		cs_char *value = (cs_char *)String_FirstChar(line, ':');
-		if(!value) break;
-		*value = '\0';value += 2;
+	z_stream *def = Memory_Alloc(1, sizeof(z_stream)),
+	*inf = Memory_Alloc(1, sizeof(z_stream));
+	cs_int32 inbits = hs->zclient ? hs->zclient : 15;
+	// Память под сжатие: окно и хэш-таблица, по 2^(zserver + 2) байт
+	if(deflateInit2(def, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -hs->zserver, hs->zserver - 7, Z_DEFAULT_STRATEGY) != Z_OK) {
+		Memory_Free(def);
+		Memory_Free(inf);
+		return;
+	}
+	if(inflateInit2(inf, -inbits) != Z_OK) {
+		deflateEnd(def);
+		Memory_Free(def);
+		Memory_Free(inf);
+		return;
+	}
 
-		if(String_CaselessCompare(line, "Sec-WebSocket-Key")) {
-			wskeylen = (cs_int32)String_Copy(wskey, 32, value);
-		} else if(String_CaselessCompare(line, "Sec-WebSocket-Version")) {
-			if(String_ToInt(value) != 13) break;
-		} else if(String_CaselessCompare(line, "Sec-WebSocket-Protocol")) {
-			if(!String_FindSubstr(value, ws->proto)) {
-				validConnection = false;
-				break;
-			}
-		} else if(String_CaselessCompare(line, "Upgrade")) {
-			validConnection = String_CaselessCompare(value, "websocket");
-			if(!validConnection) break;
-		}
+	ws->deflate = def;
+	ws->inflate = inf;
+	ws->znoctx = hs->znoctx;
+	String_Copy(ext, extlen, "Sec-WebSocket-Extensions: permessage-deflate");
+	if(hs->znoctx)
+		String_Append(ext, extlen, "; server_no_context_takeover");
+	if(hs->zserver < 15) {
+		cs_char param[32];
+		String_FormatBuf(param, 32, "; server_max_window_bits=%d", hs->zserver);
+		String_Append(ext, extlen, param);
 	}
+	if(hs->zclient) {
+		cs_char param[32];
+		String_FormatBuf(param, 32, "; client_max_window_bits=%d", hs->zclient);
+		String_Append(ext, extlen, param);
+	}
+	String_Append(ext, extlen, "\r\n");
+}
 
-	if(validConnection && wskeylen > 0) {
+static cs_bool FinishHandshake(WebSock *ws) {
+	WebSockHS *hs = ws->hs;
+
+	if(hs->valid && hs->keylen > 0) {
+		cs_char rsp[512], ext[160], b64[30];
+		cs_byte hash[20];
 		SHA_CTX ctx;
 		SHA1_Init(&ctx);
-		SHA1_Update(&ctx, wskey, wskeylen);
+		SHA1_Update(&ctx, hs->key, hs->keylen);
 		SHA1_Update(&ctx, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
 		SHA1_Final(hash, &ctx);
 		String_ToB64(hash, 20, b64);
+		StartDeflate(ws, ext, 160);
+
+		cs_int32 rsplen = String_FormatBuf(rsp, 512, WS_RESP, ws->proto, b64, ext);
+		Memory_Free(hs);
+		ws->hs = NULL;
+		if(Socket_Send(ws->sock, rsp, rsplen) == rsplen)
+			return true;
+		ws->error = WS_ERR_CLOSED;
+		return false;
+	}
+
+	return SendHandshakeError(ws, 400, "Bad request", Lang_Get(Lang_ErrGrp, 4));
+}
+
+static cs_char *TrimSpaces(cs_char *str) {
+	while(*str == ' ' || *str == '\t') str++;
+	cs_char *end = str + String_Length(str);
+	while(end > str && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+	return str;
+}
+
+/*
+** Разбирает один вариант расширения из заголовка
+** Sec-WebSocket-Extensions. Вариант с незнакомыми
+** или неподходящими параметрами отвергается.
+*/
+static cs_bool ParseDeflateOffer(WebSock *ws, cs_char *offer) {
+	WebSockHS *hs = ws->hs;
+	cs_byte zserver = ws->zbits, zclient = 0;
+	cs_bool noctx = false, first = true;
+
+	while(offer) {
+		cs_char *next = (cs_char *)String_FirstChar(offer, ';');
+		if(next) *next++ = '\0';
+		cs_char *name = TrimSpaces(offer),
+		*value = (cs_char *)String_FirstChar(name, '=');
+		cs_int32 bits = 0;
+		if(value) {
+			*value++ = '\0';
+			value = TrimSpaces(value);
+			if(*value == '"') value++;
+			bits = String_ToInt(value);
+			name = TrimSpaces(name);
+		}
+
+		if(first) {
+			if(!String_CaselessCompare(name, "permessage-deflate")) return false;
+			first = false;
+		} else if(String_CaselessCompare(name, "server_no_context_takeover"))
+			noctx = true;
+		else if(String_CaselessCompare(name, "client_no_context_takeover"))
+			(void)0; // Сброс контекста клиентом нам ничем не мешает
+		else if(String_CaselessCompare(name, "server_max_window_bits")) {
+			// zlib не умеет сжимать с окном в 256 байт
+			if(bits < 9 || bits > 15) return false;
+			zserver = (cs_byte)min(zserver, bits);
+		} else if(String_CaselessCompare(name, "client_max_window_bits")) {
+			if(value && (bits < 8 || bits > 15)) return false;
+			zclient = (cs_byte)max(9, min(ws->zbits, value ? bits : 15));
+		} else
+			return false;
 
-		rsplen = String_FormatBuf(line, 1024, WS_RESP, ws->proto, b64);
-		return Socket_Send(ws->sock, line, rsplen) == rsplen;
+		offer = next;
+	}
+
+	hs->deflate = true;
+	hs->znoctx = noctx;
+	hs->zserver = zserver;
+	hs->zclient = zclient;
+	return true;
+}
+
+/*
+** Возвращает true, если после этой строки
+** чтение заголовков следует прекратить.
+*/
+static cs_bool ProcessHandshakeLine(WebSock *ws, cs_char *line) {
+	WebSockHS *hs = ws->hs;
+
+	if(hs->firstLine) {
+		hs->firstLine = false;
+		cs_str httpver = String_LastChar(line, 'H');
+		if(!httpver || !String_CaselessCompare(httpver, "HTTP/1.1")) {
+			SendHandshakeError(ws, 505, "HTTP Version Not Supported", "");
+			return true;
+		}
+		return false;
+	}
+
+	if(*line == '\0') return true;
+
+	cs_char *value = (cs_char *)String_FirstChar(line, ':');
+	if(!value) return true;
+	*value = '\0';value += 2;
+
+	if(String_CaselessCompare(line, "Sec-WebSocket-Key")) {
+		hs->keylen = (cs_int32)String_Copy(hs->key, 32, value);
+	} else if(String_CaselessCompare(line, "Sec-WebSocket-Version")) {
+		if(String_ToInt(value) != 13) return true;
+	} else if(String_CaselessCompare(line, "Sec-WebSocket-Protocol")) {
+		if(!String_FindSubstr(value, ws->proto)) {
+			hs->valid = false;
+			return true;
+		}
+	} else if(String_CaselessCompare(line, "Sec-WebSocket-Extensions")) {
+		while(ws->zbits && !hs->deflate && value) {
+			cs_char *next = (cs_char *)String_FirstChar(value, ',');
+			if(next) *next++ = '\0';
+			ParseDeflateOffer(ws, value);
+			value = next;
+		}
+	} else if(String_CaselessCompare(line, "Upgrade")) {
+		hs->valid = String_CaselessCompare(value, "websocket");
+		if(!hs->valid) return true;
 	}
 
-	cs_str str = Lang_Get(Lang_ErrGrp, 4);
-	rsplen = String_FormatBuf(line, 1024, WS_ERRRESP, 400, "Bad request", String_Length(str), str);
-	Socket_Send(ws->sock, line, rsplen);
 	return false;
 }
 
-cs_bool WebSock_ReceiveFrame(WebSock *ws) {
-	if(ws->state == WS_ST_DONE)
-		ws->state = WS_ST_HDR;
-
-	if(ws->state == WS_ST_HDR) {
-		cs_int32 len = Socket_Receive(ws->sock, ws->header, 2, MSG_WAITALL);
-
-		if(len == 2) {
-			cs_char plen = ws->header[1] & 0x7F;
-
-			if(ws->header[1] & 0x80) {
-				ws->opcode = ws->header[0] & 0x0F;
-				ws->done = (ws->header[0] >> 0x07) & 1;
-				ws->plen = plen;
-
-				if(plen == 126) {
-					ws->state = WS_ST_PLEN;
-				} else if(plen < 126) {
-					ws->state = WS_ST_MASK;
-				} else {
-					ws->error = WS_ERR_PAYLOAD_TOO_BIG;
-					return false;
-				}
-			} else {
-				ws->error = WS_ERR_MASK;
-				return false;
+cs_bool WebSock_DoHandshake(WebSock *ws) {
+	if(!ws->proto) return false;
+	ws->error = WS_ERR_SUCC;
+
+	if(!ws->hs) {
+		ws->hs = Memory_Alloc(1, sizeof(WebSockHS));
+		ws->hs->firstLine = true;
+	}
+
+	WebSockHS *hs = ws->hs;
+	while(true) {
+		cs_int32 space = (cs_int32)sizeof(hs->buf) - 1 - hs->buflen;
+		if(space < 1) return SendHandshakeError(ws, 400, "Bad request", Lang_Get(Lang_ErrGrp, 4));
+
+		cs_int32 len = Socket_Receive(ws->sock, hs->buf + hs->buflen, space, 0);
+		if(len <= 0) {
+			if(len == 0 || !Socket_WouldBlock())
+				ws->error = WS_ERR_CLOSED;
+			return false;
+		}
+		hs->buflen += len;
+		hs->buf[hs->buflen] = '\0';
+
+		cs_char *line = hs->buf, *end = hs->buf + hs->buflen, *eol;
+		while((eol = (cs_char *)String_FirstChar(line, '\n')) != NULL) {
+			*eol = '\0';
+			if(eol > line && eol[-1] == '\r') eol[-1] = '\0';
+			if(ProcessHandshakeLine(ws, line)) {
+				if(ws->error != WS_ERR_SUCC) return false;
+				/*
+				** Всё, что пришло после заголовков, уже
+				** относится к фреймам, эти байты разберёт
+				** WebSock_Decode.
+				*/
+				ws->recvlen = (cs_uint32)(end - eol - 1);
+				Memory_Copy(ws->recvbuf, eol + 1, ws->recvlen);
+				return FinishHandshake(ws);
 			}
+			line = eol + 1;
 		}
+
+		hs->buflen = (cs_int32)(end - line);
+		Memory_Move(hs->buf, line, hs->buflen);
+		if(len < space) return false;
 	}
+}
 
-	if(ws->state == WS_ST_PLEN) {
-		cs_int32 len = Socket_Receive(ws->sock, (cs_char *)&ws->plen, 2, MSG_WAITALL);
+/*
+** Снимает маску с нагрузки фрейма. Пока позиция
+** в маске не вернулась к нулю, маска накладывается
+** побайтово, а дальше - по 8 байт. Ни src, ни dst
+** не обязаны быть выровнены, поэтому нагрузка
+** кусками копируется в локальный буфер и обратно.
+*/
+static void Unmask(WebSock *ws, cs_char *dst, const cs_char *src, cs_uint32 len) {
+	const cs_byte *mask = (const cs_byte *)&ws->mask;
+	cs_uint32 i = 0;
 
-		if(len == 2) {
-			ws->plen = ntohs(ws->plen);
-			if(ws->plen > 131) {
-				ws->error = WS_ERR_PAYLOAD_TOO_BIG;
-				return false;
-			}
-			ws->state = WS_ST_MASK;
+	for(; i < len && ws->maskpos != 0; i++) {
+		dst[i] = src[i] ^ mask[ws->maskpos];
+		ws->maskpos = (ws->maskpos + 1) & 3;
+	}
+
+	cs_uint64 mask64 = ((cs_uint64)ws->mask << 32) | ws->mask, block[8];
+	while(i + 8 <= len) {
+		cs_uint32 n = min(len - i, (cs_uint32)sizeof(block)) & ~7u;
+		Memory_Copy(block, src + i, n);
+		for(cs_uint32 j = 0; j < n / 8; j++)
+			block[j] ^= mask64;
+		Memory_Copy(dst + i, block, n);
+		i += n;
+	}
+
+	for(; i < len; i++) {
+		dst[i] = src[i] ^ mask[ws->maskpos];
+		ws->maskpos = (ws->maskpos + 1) & 3;
+	}
+}
+
+static cs_byte HeaderSize(WebSock *ws) {
+	cs_byte plen = ws->header[1] & 0x7F;
+	return 2 + (plen == 126 ? 2 : plen == 127 ? 8 : 0) + 4;
+}
+
+static cs_bool ParseHeader(WebSock *ws) {
+	cs_byte *hdr = ws->header, plen = hdr[1] & 0x7F, *ext = hdr + 2;
+	if(!(hdr[1] & 0x80)) {
+		ws->error = WS_ERR_MASK;
+		return false;
+	}
+
+	ws->opcode = hdr[0] & 0x0F;
+	if(ws->opcode == 0x08) {
+		ws->error = WS_ERR_CLOSED;
+		return false;
+	}
+
+	/*
+	** Флаг сжатия ставится только на первый фрейм
+	** сообщения с данными, продолжения и управляющие
+	** фреймы наследуют его или не сжимаются вовсе.
+	*/
+	if(ws->opcode == 0x01 || ws->opcode == 0x02) {
+		ws->compressed = (hdr[0] & WS_RSV1) != 0;
+		if(ws->compressed && !ws->inflate) {
+			ws->error = WS_ERR_DEFLATE;
+			return false;
 		}
+	} else if(hdr[0] & WS_RSV1) {
+		ws->error = WS_ERR_DEFLATE;
+		return false;
 	}
+	if(ws->opcode < 0x08)
+		ws->fin = (hdr[0] & 0x80) != 0;
 
-	if(ws->state == WS_ST_MASK) {
-		if(Socket_Receive(ws->sock, ws->mask, 4, MSG_WAITALL) == 4)
-			ws->state = WS_ST_RECVPL;
+	if(plen == 126) {
+		ws->plen = ntohs(*(cs_uint16 *)ext);
+		ext += 2;
+	} else if(plen == 127) {
+		if(*(cs_uint32 *)ext != 0) {
+			ws->error = WS_ERR_PAYLOAD_TOO_BIG;
+			return false;
+		}
+		ws->plen = ntohl(*(cs_uint32 *)(ext + 4));
+		ext += 8;
+	} else
+		ws->plen = plen;
+
+	if(ws->opcode >= 0x08 && ws->plen > WS_CTRL_MAX) {
+		ws->error = WS_ERR_PAYLOAD_TOO_BIG;
+		return false;
+	}
+	// Ответ нужен только на последний ping
+	if(ws->opcode == 0x09) {
+		ws->ctrllen = 0;
+		ws->pong = false;
 	}
 
-	if(ws->state == WS_ST_RECVPL) {
-		if(ws->plen > 0) {
-			cs_int32 len = Socket_Receive(ws->sock, ws->recvbuf, ws->plen, MSG_WAITALL);
+	Memory_Copy(&ws->mask, ext, 4);
+	ws->maskpos = 0;
+	return true;
+}
+
+// Хвост, который отправитель отрезал от каждого сжатого сообщения
+static const cs_byte ZTail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+/*
+** Распаковывает кусок сжатого сообщения в *out, сдвигая
+** его и уменьшая *cap. Возвращает количество байт in,
+** которые zlib успел поглотить.
+*/
+static cs_uint32 Inflate(WebSock *ws, const void *in, cs_uint32 inlen, cs_char **out, cs_uint32 *cap) {
+	z_stream *zs = ws->inflate;
+	zs->next_in = (Bytef *)in;
+	zs->avail_in = inlen;
+	zs->next_out = (Bytef *)*out;
+	zs->avail_out = *cap;
+
+	cs_int32 ret = inflate(zs, Z_SYNC_FLUSH);
+	if(ret == Z_STREAM_END)
+		inflateReset(zs);
+	else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+		ws->error = WS_ERR_DEFLATE;
+		return 0;
+	}
+
+	cs_uint32 produced = *cap - zs->avail_out;
+	*out += produced;
+	*cap -= produced;
+	ws->zpending = zs->avail_out == 0;
+	return inlen - zs->avail_in;
+}
+
+cs_uint32 WebSock_Decode(WebSock *ws, cs_char *out, cs_uint32 cap) {
+	cs_char *src = ws->recvbuf, *end = src + ws->recvlen, *start = out;
+	ws->error = WS_ERR_SUCC;
+
+	while(cap > 0) {
+		// Досылаем zlib'у отрезанный хвост или забираем недополученное
+		if(ws->ztail > 0 || (ws->zpending && ws->state == WS_ST_HDR)) {
+			ws->ztail -= (cs_byte)Inflate(ws, ZTail + 4 - ws->ztail, ws->ztail, &out, &cap);
+			if(ws->error != WS_ERR_SUCC) break;
+			if(!ws->zpending) ws->ztail = 0;
+			continue;
+		}
 
-			if(len == ws->plen) {
-				for(cs_int32 i = 0; i < len; i++) {
-					ws->recvbuf[i] ^= ws->mask[i % 4];
-				}
-			} else {
-				ws->error = WS_ERR_PAYLOAD_LEN_MISMATCH;
-				return false;
+		if(ws->state == WS_ST_HDR) {
+			if(src == end) break;
+			cs_byte need = ws->hdrlen < 2 ? 2 : HeaderSize(ws);
+			while(ws->hdrlen < need && src < end) {
+				ws->header[ws->hdrlen++] = *src++;
+				if(ws->hdrlen == 2) need = HeaderSize(ws);
 			}
+			if(ws->hdrlen < need) break;
+			ws->hdrlen = 0;
+			if(!ParseHeader(ws)) break;
+			ws->state = WS_ST_RECVPL;
 		}
 
-		ws->state = WS_ST_DONE;
-		return true;
+		cs_uint32 part = min(ws->plen, (cs_uint32)(end - src));
+		/*
+		** Нагрузка управляющих фреймов клиенту не нужна,
+		** но нагрузку ping надо вернуть отправителю в pong.
+		*/
+		if(ws->opcode >= 0x08) {
+			if(ws->opcode == 0x09) {
+				Unmask(ws, ws->ctrl + ws->ctrllen, src, part);
+				ws->ctrllen += (cs_byte)part;
+			}
+		} else if(ws->compressed) {
+			/*
+			** Маска снимается прямо в recvbuf. Если выходной
+			** буфер кончился раньше, чем zlib съел весь кусок,
+			** остаток маскируется обратно, чтобы следующий
+			** вызов разобрал его как ни в чём не бывало.
+			*/
+			cs_byte maskpos = ws->maskpos;
+			Unmask(ws, src, src, part);
+			cs_uint32 used = Inflate(ws, src, part, &out, &cap);
+			if(ws->error != WS_ERR_SUCC) break;
+			if(used < part) {
+				ws->maskpos = (maskpos + used) & 3;
+				Unmask(ws, src + used, src + used, part - used);
+				ws->maskpos = (maskpos + used) & 3;
+				part = used;
+			}
+		} else {
+			part = min(part, cap);
+			Unmask(ws, out, src, part);
+			out += part;
+			cap -= part;
+		}
+
+		if(part == 0 && ws->plen > 0 && !ws->zpending) break;
+		src += part;
+		ws->plen -= part;
+		if(ws->plen == 0) {
+			ws->state = WS_ST_HDR;
+			if(ws->opcode == 0x09) ws->pong = true;
+			if(ws->opcode < 0x08 && ws->compressed && ws->fin) {
+				ws->compressed = false;
+				ws->ztail = 4;
+			}
+		}
 	}
 
-	ws->error = WS_ERR_UNKNOWN;
-	return false;
+	ws->recvlen = (cs_uint32)(end - src);
+	Memory_Move(ws->recvbuf, src, ws->recvlen);
+	return (cs_uint32)(out - start);
 }
 
-cs_bool WebSock_SendFrame(WebSock *ws, cs_byte opcode, const cs_char *buf, cs_uint16 len) {
-	cs_byte hdrlen = 2;
-	cs_char hdr[4] = {0, 0, 0, 0};
+cs_int32 WebSock_Deflate(WebSock *ws, const SockVec *vec, cs_int32 count, const cs_char **out) {
+	z_stream *zs = ws->deflate;
+	cs_uint32 total = 0;
+	for(cs_int32 i = 0; i < count; i++)
+		total += vec[i].len;
+
+	// Запас на блок, который добавит Z_SYNC_FLUSH
+	cs_uint32 need = (cs_uint32)deflateBound(zs, total) + 16;
+	if(ws->zcap < need) {
+		if(ws->zbuf) Memory_Free(ws->zbuf);
+		ws->zbuf = Memory_Alloc(need, 1);
+		ws->zcap = need;
+	}
+
+	zs->next_out = (Bytef *)ws->zbuf;
+	zs->avail_out = ws->zcap;
+	for(cs_int32 i = 0; i < count; i++) {
+		zs->next_in = (Bytef *)vec[i].buf;
+		zs->avail_in = vec[i].len;
+		if(deflate(zs, i == count - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH) == Z_STREAM_ERROR || zs->avail_in > 0)
+			return -1;
+	}
+
+	cs_uint32 len = ws->zcap - zs->avail_out;
+	if(len < 4 || zs->avail_out == 0) return -1;
+	if(ws->znoctx) deflateReset(zs);
+	*out = ws->zbuf;
+	return (cs_int32)(len - 4);
+}
+
+cs_byte WebSock_WriteHeader(cs_char *hdr, cs_byte opcode, cs_uint16 len) {
 	hdr[0] = 0x80 | opcode;
 
 	if(len < 126) {
 		hdr[1] = (cs_char)len;
-	} else if(len < 65535) {
-		hdrlen = 4;
-		hdr[1] = 126;
-		*(cs_uint16 *)&hdr[2] = htons((cs_uint16)len);
-	} else return false;
-
-	return Socket_Send(ws->sock, hdr, hdrlen) == hdrlen &&
-	Socket_Send(ws->sock, buf, len) == len;
+		return 2;
+	}
+
+	hdr[1] = 126;
+	*(cs_uint16 *)&hdr[2] = htons(len);
+	return 4;
+}
+
+cs_bool WebSock_SendFrame(WebSock *ws, cs_byte opcode, const cs_char *buf, cs_uint16 len) {
+	cs_char hdr[4];
+	SockVec vec[2];
+	vec[0].buf = hdr;
+	vec[0].len = WebSock_WriteHeader(hdr, opcode, len);
+	vec[1].buf = buf;
+	vec[1].len = len;
+
+	return Socket_SendV(ws->sock, vec, 2) == (cs_int32)(vec[0].len + len);
+}
+
+void WebSock_Free(WebSock *ws) {
+	if(ws->hs) Memory_Free(ws->hs);
+	if(ws->deflate) {
+		deflateEnd(ws->deflate);
+		Memory_Free(ws->deflate);
+	}
+	if(ws->inflate) {
+		inflateEnd(ws->inflate);
+		Memory_Free(ws->inflate);
+	}
+	if(ws->zbuf) Memory_Free(ws->zbuf);
+	if(ws->recvbuf) Memory_Free(ws->recvbuf);
+	Memory_Free(ws);
 }
@@ -1,11 +1,8 @@
 #ifndef WEBSOCKET_H
 #define WEBSOCKET_H
 enum {
-	WS_ST_HDR,
-	WS_ST_PLEN,
-	WS_ST_MASK,
-	WS_ST_RECVPL,
-	WS_ST_DONE
+	WS_ST_HDR, // Получаем заголовок фрейма
+	WS_ST_RECVPL // Получаем полезную нагрузку фрейма
 };
 
 enum {
@@ -14,22 +11,79 @@ enum {
 	WS_ERR_MASK,
 	WS_ERR_PAYLOAD_TOO_BIG,
 	WS_ERR_PAYLOAD_LEN_MISMATCH,
+	WS_ERR_CLOSED,
+	WS_ERR_HANDSHAKE,
+	WS_ERR_DEFLATE
 };
 
+#define WS_RECVBUF_SIZE 4096
+#define WS_CTRL_MAX 125 // Наибольшая нагрузка управляющего фрейма
+#define WS_RSV1 0x40 // Флаг сжатого сообщения [permessage-deflate]
+
+typedef struct _WebSockHS {
+	cs_char buf[1024], // Полученные, но ещё не разобранные строки заголовка
+	key[32]; // Значение Sec-WebSocket-Key
+	cs_int32 buflen, keylen;
+	cs_bool firstLine, valid,
+	deflate, // Клиент предложил подходящий permessage-deflate
+	znoctx; // Клиент попросил сбрасывать контекст сжатия после каждого сообщения
+	cs_byte zserver, // Окно, которым будет сжимать сервер
+	zclient; // Окно, которое сервер попросит у клиента, 0 - не просить
+} WebSockHS;
+
 typedef struct _WebSock {
 	Socket sock;
 	cs_str proto;
-	cs_char *recvbuf,
-	header[2],
-	mask[4];
+	cs_char *recvbuf; // Байты, прочитанные из сокета, но ещё не разобранные на фреймы
+	cs_uint32 recvlen, // Количество таких байт
+	plen, // Сколько байт полезной нагрузки текущего фрейма ещё не получено
+	mask, // Маска текущего фрейма
+	zcap; // Размер zbuf
 	cs_int32 state,
 	error;
-	cs_uint16 plen;
-	cs_byte opcode;
-	cs_bool done;
+	cs_char ctrl[WS_CTRL_MAX]; // Нагрузка последнего ping, вернётся клиенту в pong
+	cs_byte header[14], // Недополученный заголовок фрейма
+	hdrlen,
+	ctrllen, // Сколько байт нагрузки ping уже получено
+	maskpos, // Позиция в маске для следующего байта нагрузки
+	opcode,
+	zbits, // Наибольшее окно сжатия, 0 - не сжимать трафик вовсе
+	ztail; // Сколько байт завершающего блока сообщения ещё не распаковано
+	cs_bool fin, // Текущий фрейм последний в сообщении
+	pong, // Ping получен целиком, но ответ на него ещё не поставлен в очередь
+	compressed, // Текущее сообщение сжато
+	zpending, // Распакованное не влезло в буфер, у zlib осталось ещё
+	znoctx; // Контекст сжатия сбрасывается после каждого сообщения
+	void *deflate, *inflate; // z_stream, если договорились о permessage-deflate
+	cs_char *zbuf; // Сжатое сообщение для отправки
+	WebSockHS *hs; // Существует только во время рукопожатия
 } WebSock;
 
+/*
+** Функция не блокирует поток. Если она вернула false,
+** а ws->error равен WS_ERR_SUCC, значит данных в сокете
+** пока недостаточно и функцию следует вызвать повторно,
+** когда сокет снова станет доступен для чтения.
+*/
 API cs_bool WebSock_DoHandshake(WebSock *ws);
-API cs_bool WebSock_ReceiveFrame(WebSock *ws);
+/*
+** Разбирает фреймы, лежащие в ws->recvbuf, и
+** складывает полезную нагрузку всех фреймов с
+** данными (распакованную, если сообщение сжато)
+** в out, но не больше cap байт. Возвращает её
+** размер. Разобранные байты из recvbuf убираются,
+** незаконченный фрейм дождётся следующего вызова.
+** Если после вызова ws->pong равен true, клиенту
+** нужно ответить pong фреймом с нагрузкой ws->ctrl.
+*/
+API cs_uint32 WebSock_Decode(WebSock *ws, cs_char *out, cs_uint32 cap);
+/*
+** Сжимает данные из vec в одно permessage-deflate
+** сообщение. Возвращает длину сжатых данных, которые
+** лежат в *out до следующего вызова, или -1.
+*/
+API cs_int32 WebSock_Deflate(WebSock *ws, const SockVec *vec, cs_int32 count, const cs_char **out);
+API cs_byte WebSock_WriteHeader(cs_char *hdr, cs_byte opcode, cs_uint16 len);
 API cs_bool WebSock_SendFrame(WebSock *ws, cs_byte opcode, const cs_char *buf, cs_uint16 len);
+API void WebSock_Free(WebSock *ws);
 #endif // WEBSOCKET_H
@@ -5,21 +5,58 @@
 #include "server.h"
 #include "world.h"
 #include "event.h"
+#include "lang.h"
+#include "log.h"
+#include "timer.h"
+#include "client.h"
+#include "protocol.h"
 #include <zlib.h>
 
+static cs_int32 AutosaveDelay = 0, SaveConcurrency = 1;
+static cs_uint32 SaveRate = 0; // Байт в секунду, 0 - без ограничений
+static cs_bool SaveStreams = true;
+static cs_bool Sectioned = false; // Новые массивы блоков хранятся секциями
+static cs_uint32 SleepDelay = 0; // Секунды простоя до засыпания мира, 0 - не усыплять
+static cs_uint32 UnloadDelay = 0; // Секунды простоя до выгрузки мира, 0 - не выгружать
+static cs_uint64 MemoryLimit = 0; // Байты, 0 - без ограничений
+static Mutex *ThrottleMutex = NULL;
+// Держится, пока список миров читается не из главного потока
+static Mutex *WorldsMutex = NULL;
+static cs_uint64 ThrottleNext = 0;
+
+static void WaitSaved(World *world) {
+	Waitable_Wait(world->wait);
+	if(!Server_Active) {
+		World_Free(world);
+	}
+}
+
 void Worlds_SaveAll(cs_bool join, cs_bool unload) {
+	World *started[MAX_WORLDS];
+	cs_int32 head = 0, count = 0;
+
 	for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
 		World *world = Worlds_List[i];
+		if(!world) continue;
 
-		if(i < MAX_WORLDS && world) {
-			if(World_Save(world, unload) && join) {
+		if(join) {
+			/*
+			** Изменения, сделанные во время идущего
+			** автосохранения, в него не попали, так
+			** что дожидаемся его и сохраняем мир снова.
+			*/
+			if(world->process == WP_SAVING)
 				Waitable_Wait(world->wait);
-				if(!Server_Active) {
-					World_Free(world);
-				}
-			}
+			while(count - head >= SaveConcurrency)
+				WaitSaved(started[head++]);
 		}
+
+		if(World_Save(world, unload) && join)
+			started[count++] = world;
 	}
+
+	while(head < count)
+		WaitSaved(started[head++]);
 }
 
 World *World_Create(cs_str name) {
@@ -27,6 +64,14 @@ World *World_Create(cs_str name) {
 
 	tmp->name = String_AllocCopy(name);
 	tmp->wait = Waitable_Create();
+	tmp->cacheMutex = Mutex_Create();
+	tmp->loadMutex = Mutex_Create();
+	tmp->wdata.mutex = Mutex_Create();
+	tmp->snap.mutex = Mutex_Create();
+	tmp->journal.mutex = Mutex_Create();
+	tmp->journal.syncMutex = Mutex_Create();
+	tmp->updates = Memory_Alloc(1, sizeof(WorldUpdates));
+	tmp->updates->mutex = Mutex_Create();
 	tmp->process = WP_NOPROC;
 	tmp->id = -1;
 
@@ -55,20 +100,23 @@ World *World_Create(cs_str name) {
 }
 
 cs_bool World_Add(World *world) {
+	cs_bool succ = false;
+	Mutex_Lock(WorldsMutex);
 	if(world->id == -1) {
 		for(WorldID i = 0; i < MAX_WORLDS; i++) {
 			if(!Worlds_List[i]) {
 				world->id = i;
 				Worlds_List[i] = world;
-				return true;
+				succ = true;
+				break;
 			}
 		}
-		return false;
+	} else if(world->id < MAX_WORLDS) {
+		Worlds_List[world->id] = world;
+		succ = true;
 	}
-
-	if(world->id > MAX_WORLDS) return false;
-	Worlds_List[world->id] = world;
-	return true;
+	Mutex_Unlock(WorldsMutex);
+	return succ;
 }
 
 World *World_GetByName(cs_str name) {
@@ -151,22 +199,441 @@ cs_int8 World_GetWeather(World *world) {
 	return world->info.weatherType;
 }
 
+#define SECTION_BYTES(bits) (WORLD_SECTION_VOLUME * (bits) / 8)
+
+static BlockID SectionGet(const WorldSection *sec, cs_uint32 idx) {
+	switch(sec->bits) {
+		case 0: return sec->palette[0];
+		case 8: return sec->data[idx];
+		default: {
+			cs_uint32 bit = idx * sec->bits;
+			return sec->palette[(sec->data[bit / 8] >> (bit % 8)) & ((1 << sec->bits) - 1)];
+		}
+	}
+}
+
+// Пишет в секцию индекс в палитре, либо сам блок, если палитры нет
+static void SectionPut(WorldSection *sec, cs_uint32 idx, cs_byte value) {
+	if(sec->bits == 8) {
+		sec->data[idx] = value;
+		return;
+	}
+	cs_uint32 bit = idx * sec->bits;
+	cs_byte mask = (cs_byte)(((1 << sec->bits) - 1) << (bit % 8));
+	sec->data[bit / 8] = (cs_byte)((sec->data[bit / 8] & ~mask) | (value << (bit % 8)));
+}
+
+static void SectionDecode(const WorldSection *sec, BlockID *buf) {
+	if(sec->bits == 0)
+		Memory_Fill(buf, WORLD_SECTION_VOLUME, sec->palette[0]);
+	else for(cs_uint32 i = 0; i < WORLD_SECTION_VOLUME; i++)
+		buf[i] = SectionGet(sec, i);
+}
+
+static void SectionReset(World *world, WorldSection *sec, BlockID id) {
+	if(sec->data) {
+		world->wdata.secbytes -= SECTION_BYTES(sec->bits);
+		Memory_Free(sec->data);
+		sec->data = NULL;
+	}
+	sec->bits = 0;
+	sec->count = 1;
+	sec->palette[0] = id;
+}
+
+/*
+** Упаковывает buf в секцию заново: палитра
+** собирается из блоков, которые реально есть
+** в секции, а на блок уходит минимум бит.
+*/
+static void SectionEncode(World *world, WorldSection *sec, const BlockID *buf) {
+	cs_byte index[256] = {0}, seen[256] = {0};
+	BlockID palette[WORLD_SECTION_PALETTE];
+	cs_uint32 count = 0;
+	for(cs_uint32 i = 0; i < WORLD_SECTION_VOLUME; i++) {
+		BlockID id = buf[i];
+		if(seen[id]) continue;
+		seen[id] = 1;
+		if(count < WORLD_SECTION_PALETTE) {
+			index[id] = (cs_byte)count;
+			palette[count] = id;
+		}
+		count++;
+	}
+
+	SectionReset(world, sec, buf[0]);
+	if(count == 1) return;
+	sec->bits = count <= 2 ? 1 : count <= 4 ? 2 : count <= WORLD_SECTION_PALETTE ? 4 : 8;
+	sec->count = (cs_byte)min(count, WORLD_SECTION_PALETTE);
+	Memory_Copy(sec->palette, palette, sec->count);
+	sec->data = Memory_Alloc(1, SECTION_BYTES(sec->bits));
+	world->wdata.secbytes += SECTION_BYTES(sec->bits);
+	for(cs_uint32 i = 0; i < WORLD_SECTION_VOLUME; i++)
+		SectionPut(sec, i, sec->bits == 8 ? buf[i] : index[buf[i]]);
+}
+
+static void SectionSet(World *world, WorldSection *sec, cs_uint32 idx, BlockID id) {
+	if(sec->bits == 8) {
+		sec->data[idx] = id;
+		return;
+	}
+	for(cs_byte i = 0; i < sec->count; i++) {
+		if(sec->palette[i] == id) {
+			if(sec->bits > 0) SectionPut(sec, idx, i);
+			return;
+		}
+	}
+	if(sec->count < (1 << sec->bits)) {
+		sec->palette[sec->count] = id;
+		SectionPut(sec, idx, sec->count++);
+		return;
+	}
+
+	// В палитре нет места, секцию придётся перепаковать
+	BlockID buf[WORLD_SECTION_VOLUME];
+	SectionDecode(sec, buf);
+	buf[idx] = id;
+	SectionEncode(world, sec, buf);
+}
+
+static WorldSection *LocateBlock(World *world, cs_uint32 offset, cs_uint32 *idx) {
+	struct _WorldData *wd = &world->wdata;
+	cs_uint32 dx = (cs_uint32)world->info.dimensions.x,
+	dz = (cs_uint32)world->info.dimensions.z,
+	x = offset % dx, z = offset / dx % dz, y = offset / dx / dz;
+	*idx = ((y % WORLD_SECTION_SIZE) * WORLD_SECTION_SIZE + z % WORLD_SECTION_SIZE)
+	* WORLD_SECTION_SIZE + x % WORLD_SECTION_SIZE;
+	return &wd->sections[((y / WORLD_SECTION_SIZE) * wd->secz + z / WORLD_SECTION_SIZE)
+	* wd->secx + x / WORLD_SECTION_SIZE];
+}
+
+enum {
+	SPAN_READ,
+	SPAN_WRITE,
+	SPAN_FILL // buf указывает на единственный блок
+};
+
+/*
+** Проходит отрезок массива блоков кусками,
+** не вылезающими за строку одной секции, так
+** что снаружи секционный мир выглядит тем же
+** плоским массивом. Мьютекс блоков должен
+** быть залочен.
+*/
+static void WalkSections(World *world, cs_uint32 offset, BlockID *buf, cs_uint32 len, cs_int32 mode) {
+	cs_uint32 dx = (cs_uint32)world->info.dimensions.x;
+	while(len > 0) {
+		cs_uint32 idx, x = offset % dx,
+		part = min(len, min(dx - x, WORLD_SECTION_SIZE - x % WORLD_SECTION_SIZE));
+		WorldSection *sec = LocateBlock(world, offset, &idx);
+		switch(mode) {
+			case SPAN_READ:
+				if(sec->bits == 0)
+					Memory_Fill(buf, part, sec->palette[0]);
+				else for(cs_uint32 i = 0; i < part; i++)
+					buf[i] = SectionGet(sec, idx + i);
+				break;
+			case SPAN_WRITE:
+				for(cs_uint32 i = 0; i < part; i++)
+					if(SectionGet(sec, idx + i) != buf[i])
+						SectionSet(world, sec, idx + i, buf[i]);
+				break;
+			case SPAN_FILL:
+				if(sec->bits == 0 && sec->palette[0] == *buf) break;
+				for(cs_uint32 i = 0; i < part; i++)
+					SectionSet(world, sec, idx + i, *buf);
+				break;
+		}
+		offset += part;
+		len -= part;
+		if(mode != SPAN_FILL) buf += part;
+	}
+}
+
+static void CopyBlocks(World *world, cs_uint32 offset, BlockID *dst, cs_uint32 len) {
+	if(!world->wdata.sectioned) {
+		Memory_Copy(dst, world->wdata.blocks + offset, len);
+		return;
+	}
+	Mutex_Lock(world->wdata.mutex);
+	WalkSections(world, offset, dst, len, SPAN_READ);
+	Mutex_Unlock(world->wdata.mutex);
+}
+
+static void StoreBlocks(World *world, cs_uint32 offset, const BlockID *src, cs_uint32 len) {
+	if(!world->wdata.sectioned) {
+		Memory_Copy(world->wdata.blocks + offset, src, len);
+		return;
+	}
+	Mutex_Lock(world->wdata.mutex);
+	WalkSections(world, offset, (BlockID *)src, len, SPAN_WRITE);
+	Mutex_Unlock(world->wdata.mutex);
+}
+
+static BlockID PeekBlock(World *world, cs_uint32 offset) {
+	if(!world->wdata.sectioned)
+		return world->wdata.blocks[offset];
+	if(offset >= world->wdata.size) return BLOCK_AIR;
+	cs_uint32 idx;
+	Mutex_Lock(world->wdata.mutex);
+	WorldSection *sec = LocateBlock(world, offset, &idx);
+	BlockID id = SectionGet(sec, idx);
+	Mutex_Unlock(world->wdata.mutex);
+	return id;
+}
+
+// Ставит блок, не трогая журнал и снапшот, и возвращает прежний
+static BlockID SwapBlock(World *world, cs_uint32 offset, BlockID id) {
+	BlockID oldid;
+	if(!world->wdata.sectioned) {
+		oldid = world->wdata.blocks[offset];
+		world->wdata.blocks[offset] = id;
+		return oldid;
+	}
+	if(offset >= world->wdata.size) return id;
+	cs_uint32 idx;
+	Mutex_Lock(world->wdata.mutex);
+	WorldSection *sec = LocateBlock(world, offset, &idx);
+	if((oldid = SectionGet(sec, idx)) != id)
+		SectionSet(world, sec, idx, id);
+	Mutex_Unlock(world->wdata.mutex);
+	return oldid;
+}
+
+/*
+** Блоки приходят в секции по одному, поэтому после
+** загрузки в палитрах остаются типы, которых в
+** секции уже нет. Их выкидываем, а секции из
+** одного типа блоков сворачиваем совсем.
+*/
+static void CompactSections(World *world) {
+	struct _WorldData *wd = &world->wdata;
+	if(!wd->sections) return;
+	BlockID buf[WORLD_SECTION_VOLUME];
+	Mutex_Lock(wd->mutex);
+	for(cs_uint32 i = 0; i < wd->seccount; i++) {
+		WorldSection *sec = &wd->sections[i];
+		if(sec->bits == 0) continue;
+		SectionDecode(sec, buf);
+		SectionEncode(world, sec, buf);
+	}
+	Mutex_Unlock(wd->mutex);
+}
+
+static void AllocBlocks(World *world) {
+	struct _WorldData *wd = &world->wdata;
+	if(!wd->sectioned) {
+		void *data = Memory_Alloc(wd->size + 4, 1);
+		*(cs_uint32 *)data = htonl(wd->size);
+		wd->ptr = data;
+		wd->blocks = (BlockID *)data + 4;
+		return;
+	}
+
+	SVec *dims = &world->info.dimensions;
+	wd->secx = ((cs_uint32)dims->x + WORLD_SECTION_SIZE - 1) / WORLD_SECTION_SIZE;
+	wd->secz = ((cs_uint32)dims->z + WORLD_SECTION_SIZE - 1) / WORLD_SECTION_SIZE;
+	wd->seccount = wd->secx * wd->secz *
+	(((cs_uint32)dims->y + WORLD_SECTION_SIZE - 1) / WORLD_SECTION_SIZE);
+	wd->sections = Memory_Alloc(wd->seccount, sizeof(WorldSection));
+	for(cs_uint32 i = 0; i < wd->seccount; i++)
+		wd->sections[i].count = 1;
+	wd->secbytes = 0;
+}
+
+static void FreeBlocks(World *world) {
+	struct _WorldData *wd = &world->wdata;
+	if(wd->sections) {
+		for(cs_uint32 i = 0; i < wd->seccount; i++)
+			if(wd->sections[i].data) Memory_Free(wd->sections[i].data);
+		Memory_Free(wd->sections);
+		wd->sections = NULL;
+		wd->secbytes = 0;
+	}
+	if(wd->ptr) {
+		Memory_Free(wd->ptr);
+		wd->ptr = wd->blocks = NULL;
+	}
+}
+
+static cs_uint32 BlocksSize(World *world) {
+	struct _WorldData *wd = &world->wdata;
+	if(wd->sections)
+		return wd->seccount * (cs_uint32)sizeof(WorldSection) + wd->secbytes;
+	return wd->ptr ? wd->size + 4 : 0;
+}
+
 void World_AllocBlockArray(World *world) {
-	void *data = Memory_Alloc(world->wdata.size + 4, 1);
-	*(cs_uint32 *)data = htonl(world->wdata.size);
-	world->wdata.ptr = data;
-	world->wdata.blocks = (BlockID *)data + 4;
+	world->wdata.sectioned = Sectioned;
+	AllocBlocks(world);
+	world->modcount++;
+
+	// Новый массив блоков целиком попадёт в следующее сохранение
+	WorldRegions *reg = &world->regions;
+	reg->count = (world->wdata.size + WORLD_REGION_SIZE - 1) / WORLD_REGION_SIZE;
+	if(reg->dirty) Memory_Free(reg->dirty);
+	reg->dirty = Memory_Alloc(reg->count, 1);
+	Memory_Fill(reg->dirty, reg->count, 1);
+	if(reg->index) {
+		Memory_Free(reg->index);
+		reg->index = NULL;
+	}
 	world->loaded = true;
 }
 
+/*
+** Разворачивает массив блоков спящего мира из
+** FastMap потока: это сырой deflate, порезанный
+** на 0x03 пакеты, так что распаковывать его
+** можно прямо по пакетам. Мьютекс загрузки
+** мира должен быть залочен.
+*/
+static void WakeLocked(World *world) {
+	WorldCache *cache = world->dormant;
+	if(!cache) return;
+
+	cs_uint64 start = Time_GetMSec();
+	AllocBlocks(world);
+	// Секционному миру блоки отдаются кусками через промежуточный буфер
+	cs_byte *piece = world->wdata.sectioned ? Memory_Alloc(1, WORLD_REGION_SIZE) : NULL;
+	cs_uint32 pos = 0;
+
+	cs_int32 ret;
+	z_stream stream = {0};
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+
+	if((ret = inflateInit2(&stream, -15)) == Z_OK) {
+		for(cs_uint32 i = 0; i < cache->chunks && ret == Z_OK; i++) {
+			cs_byte *packet = cache->data + i * WORLD_CHUNK_PACKET;
+			stream.next_in = packet + 3;
+			stream.avail_in = ntohs(*(cs_uint16 *)(packet + 1));
+			do {
+				cs_uint32 space = min(world->wdata.size - pos, WORLD_REGION_SIZE);
+				stream.next_out = piece ? piece : world->wdata.blocks + pos;
+				stream.avail_out = space;
+				if((ret = inflate(&stream, Z_NO_FLUSH)) == Z_BUF_ERROR && space > 0)
+					ret = Z_OK;
+				cs_uint32 got = space - stream.avail_out;
+				if(piece) StoreBlocks(world, pos, piece, got);
+				pos += got;
+			} while(ret == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+		}
+		inflateEnd(&stream);
+	}
+	if(ret != Z_STREAM_END) {
+		ERROR_PRINT(ET_ZLIB, ret, false);
+	}
+	if(piece) {
+		Memory_Free(piece);
+		CompactSections(world);
+	}
+
+	world->dormant = NULL;
+	World_ReleaseCache(cache);
+	Log_Info(Lang_Get(Lang_ConGrp, 13), world->name, (cs_int32)(Time_GetMSec() - start));
+}
+
+static void Wake(World *world) {
+	Mutex_Lock(world->loadMutex);
+	WakeLocked(world);
+	Mutex_Unlock(world->loadMutex);
+}
+
+/*
+** У ленивого мира в памяти может лежать только
+** заголовок, поэтому функции, через которые плагины
+** читают и меняют блоки, сами подгружают мир.
+** Пока счётчик pins не обнулится, мир не уснёт
+** и не выгрузится, так что каждому удачному
+** PinBlocks нужен парный UnpinBlocks. Возвращает
+** false, если загрузить мир не удалось.
+*/
+static cs_bool PinBlocks(World *world) {
+	Atomic_Inc(&world->pins);
+	if(world->loaded && world->process != WP_LOADING) {
+		if(world->dormant) Wake(world);
+		return true;
+	}
+	if(World_EnsureLoaded(world, true)) return true;
+	Atomic_Dec(&world->pins);
+	return false;
+}
+
+static void UnpinBlocks(World *world) {
+	Atomic_Dec(&world->pins);
+}
+
+/*
+** Указатель на массив блоков остаётся у плагина,
+** поэтому такой мир больше не усыпляется и не
+** выгружается, иначе указатель повиснет.
+*/
 BlockID *World_GetBlockArray(World *world, cs_uint32 *size) {
+	if(!PinBlocks(world)) {
+		if(size) *size = 0;
+		return NULL;
+	}
 	if(size) *size = World_GetBlockArraySize(world);
-	return world->wdata.blocks;
+	BlockID *blocks = world->wdata.blocks;
+	if(blocks) world->exposed = true;
+	UnpinBlocks(world);
+	return blocks;
 }
 
 void *World_GetData(World *world, cs_uint32 *size) {
+	if(!PinBlocks(world)) {
+		if(size) *size = 0;
+		return NULL;
+	}
 	if(size) *size = world->wdata.size + 4;
-	return world->wdata.ptr;
+	void *ptr = world->wdata.ptr;
+	if(ptr) world->exposed = true;
+	UnpinBlocks(world);
+	return ptr;
+}
+
+void World_ReadBlocks(World *world, cs_uint32 offset, BlockID *dst, cs_uint32 count) {
+	if(!PinBlocks(world)) {
+		Memory_Zero(dst, count);
+		return;
+	}
+	CopyBlocks(world, offset, dst, count);
+	UnpinBlocks(world);
+}
+
+static void FillBlocks(World *world, cs_uint32 offset, cs_uint32 count, BlockID id) {
+	struct _WorldData *wd = &world->wdata;
+	if(!wd->sectioned) {
+		Memory_Fill(wd->blocks + offset, count, id);
+		return;
+	}
+
+	SVec *dims = &world->info.dimensions;
+	cs_uint32 dx = (cs_uint32)dims->x, dy = (cs_uint32)dims->y,
+	dz = (cs_uint32)dims->z, end = offset + count;
+	Mutex_Lock(wd->mutex);
+	// Секции, целиком попавшие в отрезок, сразу становятся однородными
+	for(cs_uint32 i = 0; i < wd->seccount; i++) {
+		cs_uint32 sx = i % wd->secx * WORLD_SECTION_SIZE,
+		sz = i / wd->secx % wd->secz * WORLD_SECTION_SIZE,
+		sy = i / wd->secx / wd->secz * WORLD_SECTION_SIZE,
+		first = (sy * dz + sz) * dx + sx,
+		last = (min(sy + WORLD_SECTION_SIZE, dy) - 1) * dz * dx +
+		(min(sz + WORLD_SECTION_SIZE, dz) - 1) * dx +
+		min(sx + WORLD_SECTION_SIZE, dx) - 1;
+		if(first >= offset && last < end)
+			SectionReset(world, &wd->sections[i], id);
+	}
+	WalkSections(world, offset, &id, count, SPAN_FILL);
+	Mutex_Unlock(wd->mutex);
+}
+
+void World_FillBlocks(World *world, cs_uint32 offset, cs_uint32 count, BlockID id) {
+	if(!PinBlocks(world)) return;
+	FillBlocks(world, offset, count, id);
+	UnpinBlocks(world);
 }
 
 cs_uint32 World_GetBlockArraySize(World *world) {
@@ -175,7 +642,23 @@ cs_uint32 World_GetBlockArraySize(World *world) {
 
 void World_Free(World *world) {
 	Waitable_Free(world->wait);
-	if(world->id != -1) Worlds_List[world->id] = NULL;
+	for(cs_int32 i = 0; i < WC_COUNT; i++)
+		if(world->cache[i]) World_ReleaseCache(world->cache[i]);
+	if(world->dormant) World_ReleaseCache(world->dormant);
+	Mutex_Free(world->cacheMutex);
+	Mutex_Free(world->loadMutex);
+	Mutex_Free(world->wdata.mutex);
+	Mutex_Free(world->snap.mutex);
+	Mutex_Free(world->journal.mutex);
+	Mutex_Free(world->journal.syncMutex);
+	Mutex_Free(world->updates->mutex);
+	Memory_Free(world->updates);
+	if(world->grid.cells) Memory_Free(world->grid.cells);
+	if(world->id != -1) {
+		Mutex_Lock(WorldsMutex);
+		Worlds_List[world->id] = NULL;
+		Mutex_Unlock(WorldsMutex);
+	}
 	Memory_Free(world);
 }
 
@@ -183,8 +666,21 @@ static cs_bool WriteWData(cs_file fp, cs_byte dataType, void *ptr, cs_int32 size
 	return File_Write(&dataType, 1, 1, fp) && (size > 0 ? File_Write(ptr, size, 1, fp) : true);
 }
 
-static cs_bool WriteInfo(World *world, cs_file fp) {
-	cs_int32 magic = WORLD_MAGIC;
+/*
+** Место под запись DT_STREAMS резервируется
+** пустым, настоящие смещения потоков попадут
+** туда уже после записи регионов.
+*/
+static cs_bool WriteStreamsEntry(cs_file fp, cs_uint32 *streampos) {
+	*streampos = 0;
+	if(!SaveStreams) return true;
+	WorldStreams empty = {0};
+	*streampos = (cs_uint32)File_Tell(fp) + 1;
+	return WriteWData(fp, DT_STREAMS, &empty, sizeof(WorldStreams));
+}
+
+static cs_bool WriteInfo(World *world, cs_file fp, cs_uint32 *streampos) {
+	cs_int32 magic = WORLD_REGMAGIC;
 	if(!File_Write((cs_char *)&magic, 4, 1, fp)) {
 		Error_PrintSys(false);
 		return false;
@@ -196,22 +692,25 @@ static cs_bool WriteInfo(World *world, cs_file fp) {
 	WriteWData(fp, DT_WT, &wi->weatherType, 1) &&
 	WriteWData(fp, DT_PROPS, wi->props, 4 * WORLD_PROPS_COUNT) &&
 	WriteWData(fp, DT_COLORS, wi->colors, sizeof(Color3) * WORLD_COLORS_COUNT) &&
+	WriteStreamsEntry(fp, streampos) &&
 	WriteWData(fp, DT_END, NULL, 0);
 }
 
-static cs_bool ReadInfo(World *world, cs_file fp) {
+static cs_bool ReadInfo(World *world, cs_file fp, cs_uint32 *magic) {
 	cs_byte id = 0;
-	cs_uint32 magic = 0;
-	if(!File_Read(&magic, 4, 1, fp))
+	if(!File_Read(magic, 4, 1, fp))
 		return false;
 
-	if(WORLD_MAGIC != magic) {
+	if(*magic != WORLD_MAGIC && *magic != WORLD_REGMAGIC) {
 		ERROR_PRINT(ET_SERVER, EC_MAGIC, true);
 		return false;
 	}
 
 	SVec dims;
 	WorldInfo *wi = &world->info;
+	WorldRegions *reg = &world->regions;
+	reg->streampos = 0;
+	Memory_Zero(&reg->streams, sizeof(WorldStreams));
 	while(File_Read(&id, 1, 1, fp) == 1) {
 		switch (id) {
 			case DT_DIM:
@@ -239,6 +738,11 @@ static cs_bool ReadInfo(World *world, cs_file fp) {
 				if(File_Read(wi->colors, sizeof(Color3) * WORLD_COLORS_COUNT, 1, fp) != 1)
 					return false;
 				break;
+			case DT_STREAMS:
+				reg->streampos = (cs_uint32)File_Tell(fp);
+				if(File_Read(&reg->streams, sizeof(WorldStreams), 1, fp) != 1)
+					return false;
+				break;
 			case DT_END:
 				return true;
 			default:
@@ -250,26 +754,338 @@ static cs_bool ReadInfo(World *world, cs_file fp) {
 	return false;
 }
 
-#define CHUNK_SIZE 16384
+#define JOURNAL_SYNC_DELAY 100 // Как часто журнал сбрасывается на диск, в миллисекундах
 
-THREAD_FUNC(WorldSaveThread) {
-	World *world = (World *)param;
-	cs_bool succ = false;
+/*
+** Поле gen хранит поколение сохранения, в которое
+** попадёт изменение. При загрузке проигрываются
+** все записи с поколением больше, чем у индекса
+** регионов, то есть всегда какой-то хвост журнала.
+*/
+typedef struct _JournalRecord {
+	cs_uint32 offset, tick, gen;
+	BlockID oldid, newid;
+	cs_uint16 check;
+} JournalRecord;
+
+static cs_bool JournalActive = false;
+static Thread JournalSyncThread = NULL;
+
+static cs_uint16 RecordCheck(JournalRecord *rec) {
+	return (cs_uint16)crc32(0, (const Bytef *)rec, sizeof(JournalRecord) - 2);
+}
+
+static void JournalPath(World *world, cs_char *buf, cs_bool tmp) {
+	String_FormatBuf(buf, 256, "worlds" PATH_DELIM "%s.wal%s", world->name, tmp ? ".tmp" : "");
+}
+
+static cs_uint32 ReplayJournal(World *world) {
 	cs_char path[256];
-	cs_char tmpname[256];
-	String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
-	String_FormatBuf(tmpname, 256, "worlds" PATH_DELIM "%s.tmp", world->name);
+	JournalPath(world, path, false);
+	cs_file fp = File_Open(path, "rb");
+	if(!fp) return 0;
 
-	cs_file fp = File_Open(tmpname, "wb");
-	if(!fp) {
+	JournalRecord rec;
+	cs_uint32 count = 0;
+	while(File_Read(&rec, sizeof(JournalRecord), 1, fp) == 1 && rec.check == RecordCheck(&rec)) {
+		if(rec.gen <= world->regions.gen || rec.offset >= world->wdata.size) continue;
+		SwapBlock(world, rec.offset, rec.newid);
+		world->regions.dirty[rec.offset / WORLD_REGION_SIZE] = 1;
+		count++;
+	}
+	File_Close(fp);
+
+	if(count > 0) {
+		world->modified = true;
+		world->modcount++;
+		Log_Info(Lang_Get(Lang_ConGrp, 9), count, world->name);
+	}
+	return count;
+}
+
+// Копирует ещё не сохранённые записи, возвращает позицию после последней целой записи
+static long CopyRecords(World *world, cs_file in, cs_file out, long pos, cs_bool *copied) {
+	JournalRecord rec;
+	while(File_Read(&rec, sizeof(JournalRecord), 1, in) == 1 && rec.check == RecordCheck(&rec)) {
+		pos += sizeof(JournalRecord);
+		if(rec.gen > world->regions.gen) {
+			File_Write(&rec, sizeof(JournalRecord), 1, out);
+			if(copied) *copied = true;
+		}
+	}
+	return pos;
+}
+
+/*
+** Переписывает журнал, оставляя в нём только
+** записи, которые ещё не попали в сохранение.
+** Заодно отрезается недописанный при крахе хвост.
+** Вызывается под syncMutex журнала. Основная часть
+** копируется и сбрасывается на диск без мьютекса
+** журнала, под ним дописывается лишь хвост, успевший
+** набежать за это время, и подменяется файл.
+*/
+static cs_bool CompactJournal(World *world, cs_bool keep) {
+	WorldJournal *jr = &world->journal;
+	cs_char path[256], tmppath[256];
+	JournalPath(world, path, false);
+	JournalPath(world, tmppath, true);
+
+	Mutex_Lock(jr->mutex);
+	if(jr->fp) File_Flush(jr->fp);
+	Mutex_Unlock(jr->mutex);
+
+	cs_bool succ = false, tail = false;
+	long pos = 0;
+	cs_file in = keep ? File_Open(path, "rb") : NULL;
+	cs_file out = File_Open(tmppath, "wb");
+	if(out) {
+		if(in) pos = CopyRecords(world, in, out, 0, NULL);
+		succ = File_Sync(out);
+	}
+
+	Mutex_Lock(jr->mutex);
+	if(jr->fp) {
+		if(succ && in) {
+			File_Flush(jr->fp);
+			File_Seek(in, pos, SEEK_SET);
+			CopyRecords(world, in, out, pos, &tail);
+			succ = File_Flush(out);
+		}
+		File_Close(jr->fp);
+		jr->fp = NULL;
+	}
+	if(in) File_Close(in);
+	if(out) {
+		File_Close(out);
+		if(succ) succ = File_Rename(tmppath, path);
+	}
+
+	jr->fp = File_Open(path, "ab");
+	// Хвост на диск сбросит поток журнала
+	jr->dirty = tail;
+	if(!succ || !jr->fp) {
 		Error_PrintSys(false);
-		goto world_save_end;
 	}
+	succ = succ && jr->fp != NULL;
+	Mutex_Unlock(jr->mutex);
+	return succ;
+}
+
+static void OpenJournal(World *world, cs_bool keep) {
+	WorldJournal *jr = &world->journal;
+	Mutex_Lock(jr->syncMutex);
+	Mutex_Lock(jr->mutex);
+	jr->gen = world->regions.gen + 1;
+	Mutex_Unlock(jr->mutex);
+	CompactJournal(world, keep);
+	Mutex_Unlock(jr->syncMutex);
+}
+
+cs_bool World_OpenJournal(World *world) {
+	OpenJournal(world, false);
+	return world->journal.fp != NULL;
+}
+
+static void CloseJournal(World *world) {
+	WorldJournal *jr = &world->journal;
+	Mutex_Lock(jr->syncMutex);
+	Mutex_Lock(jr->mutex);
+	cs_file fp = jr->fp;
+	jr->fp = NULL;
+	jr->dirty = false;
+	Mutex_Unlock(jr->mutex);
+	if(fp) {
+		File_Sync(fp);
+		File_Close(fp);
+	}
+	Mutex_Unlock(jr->syncMutex);
+}
+
+static void WriteJournal(World *world, cs_uint32 offset, BlockID oldid, BlockID newid) {
+	WorldJournal *jr = &world->journal;
+	JournalRecord rec;
+	rec.offset = offset;
+	rec.tick = (cs_uint32)Time_GetMSec();
+	rec.oldid = oldid;
+	rec.newid = newid;
+
+	Mutex_Lock(jr->mutex);
+	if(jr->fp) {
+		// Поколение читается уже после записи блока, см. BeginSnapshot
+		rec.gen = jr->gen;
+		rec.check = RecordCheck(&rec);
+		File_Write(&rec, sizeof(JournalRecord), 1, jr->fp);
+		jr->dirty = true;
+	}
+	Mutex_Unlock(jr->mutex);
+}
+
+THREAD_FUNC(JournalThread) {
+	(void)param;
+	while(JournalActive) {
+		Thread_Sleep(JOURNAL_SYNC_DELAY);
+		// World_Free не выкинет мир из списка, пока идёт fsync
+		Mutex_Lock(WorldsMutex);
+		for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
+			World *world = Worlds_List[i];
+			if(!world || !world->journal.dirty) continue;
+			WorldJournal *jr = &world->journal;
+			/*
+			** fsync идёт без мьютекса журнала, чтобы не
+			** тормозить WriteJournal, а закрыть или подменить
+			** файл в это время не даёт syncMutex.
+			*/
+			Mutex_Lock(jr->syncMutex);
+			Mutex_Lock(jr->mutex);
+			cs_file fp = jr->dirty ? jr->fp : NULL;
+			jr->dirty = false;
+			Mutex_Unlock(jr->mutex);
+			if(fp) File_Sync(fp);
+			Mutex_Unlock(jr->syncMutex);
+		}
+		Mutex_Unlock(WorldsMutex);
+	}
+	return 0;
+}
+
+static void BeginSnapshot(World *world) {
+	WorldSnapshot *snap = &world->snap;
+	cs_uint32 chunks = (world->wdata.size + WORLD_REGION_SIZE - 1) / WORLD_REGION_SIZE;
+
+	/*
+	** World_SetBlockO проверяет, нужна ли копия куска,
+	** и пишет блок под этим же мьютексом. Поэтому любая
+	** запись либо целиком закончилась до начала снапшота,
+	** либо уже видит его активным и сначала копирует кусок.
+	*/
+	Mutex_Lock(snap->mutex);
+	snap->chunks = chunks;
+	/*
+	** Новые записи журнала относим к следующему
+	** сохранению ещё до активации снапшота: так
+	** любое изменение, записанное в журнал со
+	** старым поколением, точно попадёт в снапшот.
+	*/
+	Mutex_Lock(world->journal.mutex);
+	world->journal.gen = world->regions.gen + 2;
+	Mutex_Unlock(world->journal.mutex);
+
+	snap->copies = Memory_Alloc(chunks, sizeof(cs_byte *));
+	snap->dirty = Memory_Alloc(chunks, 1);
+	Memory_Copy(snap->dirty, world->regions.dirty, chunks);
+	Memory_Zero(world->regions.dirty, chunks);
+	snap->modcount = world->modcount;
+	snap->active = true;
+	world->modified = false;
+	Mutex_Unlock(snap->mutex);
+}
+
+static void EndSnapshot(World *world, cs_bool succ) {
+	WorldSnapshot *snap = &world->snap;
+
+	Mutex_Lock(snap->mutex);
+	snap->active = false;
+	for(cs_uint32 i = 0; i < snap->chunks; i++)
+		if(snap->copies[i]) Memory_Free(snap->copies[i]);
+	Memory_Free(snap->copies);
+	snap->copies = NULL;
+	// Изменения, попавшие в неудачный снапшот, придётся сохранить снова
+	if(!succ) {
+		for(cs_uint32 i = 0; i < snap->chunks; i++)
+			world->regions.dirty[i] |= snap->dirty[i];
+		world->modified = true;
+	}
+	Memory_Free(snap->dirty);
+	snap->dirty = NULL;
+	Mutex_Unlock(snap->mutex);
+}
+
+// Вызывается под мьютексом снапшота
+static void TouchSnapshot(World *world, cs_uint32 chunk) {
+	WorldSnapshot *snap = &world->snap;
+
+	if(snap->active && !snap->copies[chunk]) {
+		cs_uint32 offset = chunk * WORLD_REGION_SIZE,
+		len = min(world->wdata.size - offset, WORLD_REGION_SIZE);
+		snap->copies[chunk] = Memory_Alloc(1, len);
+		CopyBlocks(world, offset, snap->copies[chunk], len);
+	}
+}
+
+/*
+** Копирует часть массива блоков в том
+** виде, в котором он был на момент
+** начала сохранения.
+*/
+static void ReadSnapshot(World *world, cs_uint32 offset, cs_byte *dst, cs_uint32 len) {
+	WorldSnapshot *snap = &world->snap;
+
+	while(len > 0) {
+		cs_uint32 chunk = offset / WORLD_REGION_SIZE,
+		chunkoff = offset % WORLD_REGION_SIZE,
+		part = min(len, WORLD_REGION_SIZE - chunkoff);
+
+		Mutex_Lock(snap->mutex);
+		if(snap->copies[chunk])
+			Memory_Copy(dst, snap->copies[chunk] + chunkoff, part);
+		else
+			CopyBlocks(world, offset, dst, part);
+		Mutex_Unlock(snap->mutex);
+
+		offset += part;
+		dst += part;
+		len -= part;
+	}
+}
+
+#define CHUNK_SIZE 16384
+#define SLICE_MIN_SIZE 262144 // Меньшие куски не окупают запуск потока
+#define SLICE_MAX_COUNT 32
+#define SLICE_DICT_SIZE 32768
+
+/*
+** Поток блоков режется на куски, которые
+** сжимаются параллельно. Каждый кусок, кроме
+** последнего, заканчивается на Z_SYNC_FLUSH,
+** то есть на границе байта и без флага последнего
+** блока, поэтому результат можно просто склеить
+** в один валидный deflate поток. Чтобы сжатие не
+** проседало на стыках, в качестве словаря куску
+** отдаются последние 32 КБ предыдущего.
+*/
+typedef struct _DeflateSlice {
+	World *world;
+	cs_uint32 start, // Смещение куска в потоке
+	inlen, outlen, crc;
+	cs_byte *out;
+	cs_bool snapshot, // Блоки читаются из снапшота мира
+	prefix, // Поток начинается с размера массива блоков
+	first, last, ok;
+} DeflateSlice;
 
-	if(!WriteInfo(world, fp))
-		goto world_save_end;
+/*
+** Читает часть сжимаемого потока. Блоки берутся
+** через CopyBlocks, поэтому для сжатия мир не
+** обязан лежать в памяти одним массивом.
+*/
+static void SliceRead(DeflateSlice *slice, cs_uint32 pos, cs_byte *dst, cs_uint32 len) {
+	World *world = slice->world;
+	if(slice->prefix) {
+		cs_uint32 size = htonl(world->wdata.size);
+		for(; pos < 4 && len > 0; pos++, len--)
+			*dst++ = ((cs_byte *)&size)[pos];
+		pos -= 4;
+	}
+	if(len == 0) return;
+	if(slice->snapshot)
+		ReadSnapshot(world, pos, dst, len);
+	else
+		CopyBlocks(world, pos, dst, len);
+}
 
-	Bytef out[CHUNK_SIZE];
+THREAD_FUNC(DeflateSliceThread) {
+	DeflateSlice *slice = (DeflateSlice *)param;
 	cs_int32 ret;
 	z_stream stream = {0};
 	stream.zalloc = Z_NULL;
@@ -280,121 +1096,872 @@ THREAD_FUNC(WorldSaveThread) {
 		&stream,
 		Z_DEFAULT_COMPRESSION,
 		Z_DEFLATED,
-		31,
+		-15,
 		8,
 		Z_DEFAULT_STRATEGY
 	)) != Z_OK) {
 		ERROR_PRINT(ET_ZLIB, ret, false);
-		goto world_save_end;
+		return 0;
 	}
 
-	stream.next_in = World_GetBlockArray(world, &stream.avail_in);
-
-	cs_byte zstate = 0;
-	do {
-		stream.next_out = out;
-		stream.avail_out = CHUNK_SIZE;
+	cs_byte *piece = Memory_Alloc(1, WORLD_REGION_SIZE);
+	if(!slice->first) {
+		SliceRead(slice, slice->start - SLICE_DICT_SIZE, piece, SLICE_DICT_SIZE);
+		deflateSetDictionary(&stream, piece, SLICE_DICT_SIZE);
+	}
 
-		if((ret = deflate(&stream, zstate == 0 ? Z_NO_FLUSH : Z_FINISH)) == Z_STREAM_ERROR) {
-			ERROR_PRINT(ET_ZLIB, ret, false);
-			goto world_save_end;
-		}
+	cs_uint32 cap = (cs_uint32)deflateBound(&stream, slice->inlen) + 64,
+	done = 0;
+	slice->out = Memory_Alloc(1, cap);
+	stream.next_out = slice->out;
+	stream.avail_out = cap;
 
-		if(stream.avail_out == CHUNK_SIZE) {
-			if(zstate == 1)
-				zstate = 2;
-			else
-				zstate = 1;
-		} else {
-			if(!File_Write(out, 1, CHUNK_SIZE - stream.avail_out, fp)) {
-				Error_PrintSys(false);
-				goto world_save_end;
-			}
-		}
-	} while(zstate != 2);
-	succ = (stream.avail_in == 0);
+	do {
+		cs_uint32 part = min(slice->inlen - done, WORLD_REGION_SIZE);
+		SliceRead(slice, slice->start + done, piece, part);
+		slice->crc = (cs_uint32)crc32(slice->crc, piece, part);
+		stream.next_in = piece;
+		stream.avail_in = part;
+		done += part;
+		ret = deflate(&stream, done < slice->inlen ? Z_NO_FLUSH :
+			(slice->last ? Z_FINISH : Z_SYNC_FLUSH)
+		);
+	} while(ret == Z_OK && done < slice->inlen);
+	if(slice->last)
+		slice->ok = ret == Z_STREAM_END;
+	else
+		slice->ok = ret == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+	if(!slice->ok) {
+		ERROR_PRINT(ET_ZLIB, ret, false);
+	}
 
-	world_save_end:
-	File_Close(fp);
+	slice->outlen = cap - stream.avail_out;
+	Memory_Free(piece);
 	deflateEnd(&stream);
-	world->process = WP_NOPROC;
-	if(succ)
-		File_Rename(tmpname, path);
-	Waitable_Signal(world->wait);
-	if(world->saveUnload)
-		World_Unload(world);
 	return 0;
 }
 
-cs_bool World_Save(World *world, cs_bool unload) {
-	if(world->process != WP_NOPROC || !world->modified || !world->loaded)
-		return world->process == WP_SAVING;
-	world->process = WP_SAVING;
-	world->saveUnload = unload;
-	Waitable_Reset(world->wait);
-	Thread_Create(WorldSaveThread, world, true);
-	return true;
-}
+/*
+** Сжимает массив блоков мира целиком, используя
+** все ядра процессора. Если gzip равен true, перед
+** блоками идёт их количество, а результат
+** оборачивается в gzip заголовок, иначе
+** возвращается сырой deflate поток.
+*/
+static cs_byte *ParallelDeflate(World *world, cs_bool gzip, cs_uint32 *outlen) {
+	cs_uint32 len = world->wdata.size + (gzip ? 4 : 0);
+	cs_uint32 count = Process_GetCoreCount();
+	if(count > SLICE_MAX_COUNT) count = SLICE_MAX_COUNT;
+	if(count > len / SLICE_MIN_SIZE) count = len / SLICE_MIN_SIZE;
+	if(count < 1) count = 1;
 
-THREAD_FUNC(WorldLoadThread) {
-	World *world = (World *)param;
-	cs_bool error = true;
-	cs_char path[256];
-	String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
+	DeflateSlice slices[SLICE_MAX_COUNT] = {0};
+	Thread threads[SLICE_MAX_COUNT] = {0};
+	cs_uint32 step = len / count;
 
-	cs_file fp = File_Open(path, "rb");
-	if(!fp) {
-		Error_PrintSys(false);
-		goto world_load_done;
+	for(cs_uint32 i = 0; i < count; i++) {
+		DeflateSlice *slice = &slices[i];
+		slice->world = world;
+		slice->prefix = gzip;
+		slice->start = i * step;
+		slice->inlen = i == count - 1 ? len - i * step : step;
+		slice->first = i == 0;
+		slice->last = i == count - 1;
+		if(i > 0) threads[i] = Thread_Create(DeflateSliceThread, slice, false);
 	}
 
-	if(!ReadInfo(world, fp))
-		goto world_load_done;
-
-	World_AllocBlockArray(world);
+	DeflateSliceThread(&slices[0]);
+	for(cs_uint32 i = 1; i < count; i++) {
+		if(Thread_IsValid(threads[i]))
+			Thread_Join(threads[i]);
+		else
+			DeflateSliceThread(&slices[i]);
+	}
 
-	cs_int32 ret;
-	Bytef in[CHUNK_SIZE];
-	z_stream stream = {0};
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
+	cs_bool ok = true;
+	cs_uint32 total = gzip ? 18 : 0, crc = 0;
+	for(cs_uint32 i = 0; i < count; i++) {
+		ok = ok && slices[i].ok;
+		total += slices[i].outlen;
+		crc = (cs_uint32)crc32_combine(crc, slices[i].crc, slices[i].inlen);
+	}
 
-	if((ret = inflateInit2(&stream, 31)) != Z_OK) {
-		ERROR_PRINT(ET_ZLIB, ret, false);
-		goto world_load_done;
+	cs_byte *out = NULL;
+	if(ok) {
+		cs_byte *ptr = out = Memory_Alloc(1, total);
+		if(gzip) {
+			static const cs_byte header[10] = {0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF};
+			Memory_Copy(ptr, header, 10);
+			ptr += 10;
+		}
+		for(cs_uint32 i = 0; i < count; i++) {
+			Memory_Copy(ptr, slices[i].out, slices[i].outlen);
+			ptr += slices[i].outlen;
+		}
+		if(gzip) {
+			for(cs_int32 i = 0; i < 4; i++) ptr[i] = (cs_byte)(crc >> (i * 8));
+			for(cs_int32 i = 0; i < 4; i++) ptr[i + 4] = (cs_byte)(len >> (i * 8));
+		}
+		*outlen = total;
 	}
 
-	stream.next_out = World_GetBlockArray(world, NULL);
+	for(cs_uint32 i = 0; i < count; i++)
+		if(slices[i].out) Memory_Free(slices[i].out);
 
-	do {
-		stream.avail_in = (uLongf)File_Read(in, 1, CHUNK_SIZE, fp);
-		if(File_Error(fp)) {
-			Error_PrintSys(false);
-			goto world_load_done;
-		}
+	return out;
+}
+
+typedef struct _RegionJob {
+	DeflateSlice *slices;
+	cs_int32 count;
+	cs_int32 volatile next;
+} RegionJob;
+
+THREAD_FUNC(RegionJobThread) {
+	RegionJob *job = (RegionJob *)param;
+	cs_int32 i;
+	while((i = Atomic_Inc(&job->next) - 1) < job->count)
+		DeflateSliceThread(&job->slices[i]);
+	return 0;
+}
+
+/*
+** Общий для всех сохранений лимит скорости
+** записи: каждый вызов резервирует за собой
+** отрезок времени, пропорциональный размеру
+** данных, и ждёт, пока до него дойдёт очередь.
+*/
+static void Throttle(cs_uint32 bytes) {
+	if(!SaveRate) return;
+	Mutex_Lock(ThrottleMutex);
+	cs_uint64 now = Time_GetMSec();
+	if(ThrottleNext < now) ThrottleNext = now;
+	cs_uint64 wait = ThrottleNext - now;
+	ThrottleNext += (cs_uint64)bytes * 1000 / SaveRate;
+	Mutex_Unlock(ThrottleMutex);
+	if(wait > 0) Thread_Sleep((cs_uint32)wait);
+}
+
+/*
+** Сжимает перечисленные регионы из снапшота
+** мира и дописывает их в файл с текущей
+** позиции, запоминая их положение в index.
+*/
+static cs_bool WriteRegions(World *world, cs_file fp, cs_uint32 *list, cs_int32 count, cs_uint32 *index) {
+	if(count == 0) return true;
+	DeflateSlice *slices = Memory_Alloc(count, sizeof(DeflateSlice));
+	for(cs_int32 i = 0; i < count; i++) {
+		DeflateSlice *slice = &slices[i];
+		cs_uint32 offset = list[i] * WORLD_REGION_SIZE;
+		slice->world = world;
+		slice->snapshot = true;
+		slice->start = offset;
+		slice->inlen = min(world->wdata.size - offset, WORLD_REGION_SIZE);
+		slice->first = slice->last = true;
+	}
+
+	RegionJob job = {slices, count, 0};
+	Thread threads[SLICE_MAX_COUNT] = {0};
+	cs_int32 tcount = min(Process_GetCoreCount(), SLICE_MAX_COUNT);
+	if(tcount > count) tcount = count;
+	for(cs_int32 i = 1; i < tcount; i++)
+		threads[i] = Thread_Create(RegionJobThread, &job, false);
+	RegionJobThread(&job);
+	for(cs_int32 i = 1; i < tcount; i++)
+		if(Thread_IsValid(threads[i])) Thread_Join(threads[i]);
+
+	cs_bool succ = true;
+	long pos = File_Tell(fp);
+	for(cs_int32 i = 0; i < count && succ; i++) {
+		DeflateSlice *slice = &slices[i];
+		if(!slice->ok) {
+			succ = false;
+			break;
+		}
+		index[list[i] * 2] = (cs_uint32)pos;
+		index[list[i] * 2 + 1] = slice->outlen;
+		if(world->saveThrottle) Throttle(slice->outlen);
+		if(!File_Write(slice->out, 1, slice->outlen, fp)) {
+			Error_PrintSys(false);
+			succ = false;
+		}
+		pos += slice->outlen;
+	}
+
+	for(cs_int32 i = 0; i < count; i++)
+		if(slices[i].out) Memory_Free(slices[i].out);
+	Memory_Free(slices);
+	return succ;
+}
+
+#define INDEX_SLOT_SIZE(reg) (((reg)->count + 1) * 8)
+
+static cs_uint32 IndexCRC(cs_uint32 gen, const cs_uint32 *index, cs_uint32 count) {
+	uLong crc = crc32(0, (const Bytef *)&gen, 4);
+	return (cs_uint32)crc32(crc, (const Bytef *)index, count * 8);
+}
+
+static cs_bool WriteIndex(WorldRegions *reg, cs_file fp, cs_uint32 indexpos, cs_uint32 *index, cs_uint32 gen) {
+	cs_uint32 hdr[2] = {gen, IndexCRC(gen, index, reg->count)};
+	if(File_Seek(fp, indexpos + (gen & 1) * INDEX_SLOT_SIZE(reg), SEEK_SET) != 0 ||
+	!File_Write(hdr, 8, 1, fp) || !File_Write(index, reg->count * 8, 1, fp) ||
+	!File_Sync(fp)) {
+		Error_PrintSys(false);
+		return false;
+	}
+	return true;
+}
+
+static cs_bool InfoEquals(const WorldInfo *a, const WorldInfo *b) {
+	if(!SVec_Compare(&a->dimensions, &b->dimensions) ||
+	!Vec_Compare(&a->spawnVec, &b->spawnVec) ||
+	!Ang_Compare(&a->spawnAng, &b->spawnAng) ||
+	a->weatherType != b->weatherType)
+		return false;
+	for(cs_int32 i = 0; i < WORLD_PROPS_COUNT; i++)
+		if(a->props[i] != b->props[i]) return false;
+	for(cs_int32 i = 0; i < WORLD_COLORS_COUNT; i++) {
+		const Color3 *ca = &a->colors[i], *cb = &b->colors[i];
+		if(ca->r != cb->r || ca->g != cb->g || ca->b != cb->b) return false;
+	}
+	return true;
+}
+
+static cs_uint32 StreamsCRC(const WorldStreams *ws) {
+	return (cs_uint32)crc32(0, (const Bytef *)ws, sizeof(WorldStreams) - 4);
+}
+
+static cs_uint32 StreamsSize(const WorldStreams *ws) {
+	cs_uint32 size = 0;
+	if(ws->gen > 0)
+		for(cs_int32 i = 0; i < WC_COUNT; i++)
+			size += ws->chunks[i] * WORLD_CHUNK_PACKET;
+	return size;
+}
+
+/*
+** Дописывает в конец файла потоки карты из кэша
+** мира и отмечает их в заголовке. Годятся они,
+** только если с начала сохранения в мире не
+** поменялось ни одного блока, иначе ws->gen
+** останется нулевым. Возвращает количество
+** дописанных в файл байт.
+*/
+static cs_uint32 WriteStreams(World *world, cs_file fp, cs_uint32 streampos, cs_uint32 gen, WorldStreams *ws) {
+	cs_uint32 written = 0;
+	Memory_Zero(ws, sizeof(WorldStreams));
+	if(streampos == 0 || world->modcount != world->snap.modcount)
+		return 0;
+	if(File_Seek(fp, 0, SEEK_END) != 0) {
+		Error_PrintSys(false);
+		return 0;
+	}
+
+	for(cs_int32 i = 0; i < WC_COUNT; i++) {
+		WorldCache *cache = World_GetCache(world, i);
+		if(!cache) return written;
+		cs_bool ok = cache->modcount == world->snap.modcount;
+		if(ok) {
+			ws->offset[i] = (cs_uint32)File_Tell(fp);
+			ws->chunks[i] = cache->chunks;
+			if(world->saveThrottle) Throttle(cache->chunks * WORLD_CHUNK_PACKET);
+			ok = File_Write(cache->data, WORLD_CHUNK_PACKET, cache->chunks, fp) == cache->chunks;
+			if(ok) written += cache->chunks * WORLD_CHUNK_PACKET;
+			else {
+				Error_PrintSys(false);
+			}
+		}
+		World_ReleaseCache(cache);
+		if(!ok) return written;
+	}
+
+	// Блоки могли поменяться, пока собирался кэш
+	if(world->modcount != world->snap.modcount)
+		return written;
+
+	ws->gen = gen;
+	ws->crc = StreamsCRC(ws);
+	if(!File_Flush(fp) || File_Seek(fp, streampos, SEEK_SET) != 0 ||
+	!File_Write(ws, sizeof(WorldStreams), 1, fp) || !File_Flush(fp)) {
+		Error_PrintSys(false);
+		ws->gen = 0;
+	}
+	return written;
+}
+
+THREAD_FUNC(WorldSaveThread) {
+	World *world = (World *)param;
+	WorldRegions *reg = &world->regions;
+	WorldInfo info = world->info;
+	cs_uint64 start = Time_GetMSec();
+	long written = 0;
+	cs_bool succ = false, full = true;
+	cs_char path[256];
+	cs_char tmpname[256];
+	String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
+	String_FormatBuf(tmpname, 256, "worlds" PATH_DELIM "%s.tmp", world->name);
+
+	cs_uint32 *index = Memory_Alloc(reg->count, 8),
+	*list = Memory_Alloc(reg->count, sizeof(cs_uint32)),
+	indexpos = reg->indexpos, garbage = 0, gen = reg->gen + 1,
+	streampos = reg->streampos;
+	WorldStreams streams = {0};
+	cs_int32 count = 0;
+	cs_file fp = NULL;
+
+	/*
+	** Файл переписывается целиком, если он ещё
+	** в старом формате, если поменялся заголовок
+	** мира, если устаревших регионов в нём
+	** накопилось больше, чем актуальных, или
+	** если в заголовке нет места под потоки карты.
+	*/
+	if(reg->index && reg->garbage <= reg->used && InfoEquals(&reg->info, &info) &&
+	(reg->streampos || !SaveStreams))
+		fp = File_Open(path, "r+b");
+
+	if(fp) {
+		full = false;
+		// Старые потоки карты устареют вместе с индексом
+		garbage = reg->garbage + StreamsSize(&reg->streams);
+		Memory_Copy(index, reg->index, reg->count * 8);
+		for(cs_uint32 i = 0; i < reg->count; i++) {
+			if(world->snap.dirty[i]) {
+				garbage += index[i * 2 + 1];
+				list[count++] = i;
+			}
+		}
+
+		if(File_Seek(fp, 0, SEEK_END) != 0) {
+			Error_PrintSys(false);
+			goto world_save_end;
+		}
+	} else {
+		fp = File_Open(tmpname, "wb");
+		if(!fp) {
+			Error_PrintSys(false);
+			goto world_save_end;
+		}
+
+		if(!WriteInfo(world, fp, &streampos))
+			goto world_save_end;
+
+		cs_uint32 hdr[2] = {WORLD_REGION_SIZE, reg->count};
+		if(!File_Write(hdr, 8, 1, fp)) {
+			Error_PrintSys(false);
+			goto world_save_end;
+		}
+
+		// Оба слота индекса изначально пустые
+		indexpos = (cs_uint32)File_Tell(fp);
+		void *slots = Memory_Alloc(2, INDEX_SLOT_SIZE(reg));
+		cs_bool written = File_Write(slots, INDEX_SLOT_SIZE(reg), 2, fp) == 2;
+		Memory_Free(slots);
+		if(!written) {
+			Error_PrintSys(false);
+			goto world_save_end;
+		}
+
+		for(cs_uint32 i = 0; i < reg->count; i++)
+			list[count++] = i;
+	}
+
+	long pos = File_Tell(fp);
+	succ = WriteRegions(world, fp, list, count, index);
+	/*
+	** CRC индекса не покрывает сами регионы, так что
+	** при записи на место индекс не должен попасть на
+	** диск раньше регионов, на которые он ссылается.
+	*/
+	if(succ && !full && !File_Sync(fp)) {
+		Error_PrintSys(false);
+		succ = false;
+	}
+	written = full ? File_Tell(fp) : File_Tell(fp) - pos + INDEX_SLOT_SIZE(reg);
+	succ = succ && WriteIndex(reg, fp, indexpos, index, gen);
+	if(succ) {
+		cs_uint32 streambytes = WriteStreams(world, fp, streampos, gen, &streams);
+		if(streams.gen == 0) garbage += streambytes;
+		written += streambytes;
+	}
+
+	/*
+	** Журнал ниже сжимается, и его записи пропадут,
+	** поэтому сохранение считается удачным, только
+	** когда файл мира на самом деле лежит на диске.
+	*/
+	if(succ && !File_Sync(fp)) {
+		Error_PrintSys(false);
+		succ = false;
+	}
+
+	world_save_end:
+	if(fp) File_Close(fp);
+	/*
+	** Клиенты открывают файл мира под мьютексом
+	** кэша, поэтому новый файл и смещения потоков
+	** в нём становятся видны им одновременно.
+	*/
+	Mutex_Lock(world->cacheMutex);
+	if(succ && full)
+		succ = File_Rename(tmpname, path) && Directory_Sync("worlds");
+	if(succ) {
+		reg->streampos = streampos;
+		reg->streams = streams;
+		reg->streammod = world->snap.modcount;
+	}
+	Mutex_Unlock(world->cacheMutex);
+	if(succ) {
+		if(reg->index) Memory_Free(reg->index);
+		reg->index = index;
+		index = NULL;
+		reg->indexpos = indexpos;
+		reg->gen = gen;
+		reg->garbage = garbage;
+		reg->used = StreamsSize(&reg->streams);
+		for(cs_uint32 i = 0; i < reg->count; i++)
+			reg->used += reg->index[i * 2 + 1];
+		reg->info = info;
+		Mutex_Lock(world->journal.syncMutex);
+		if(world->journal.fp) CompactJournal(world, true);
+		Mutex_Unlock(world->journal.syncMutex);
+		Log_Info(Lang_Get(Lang_ConGrp, 8), world->name,
+			(cs_int32)(Time_GetMSec() - start), (cs_int32)written
+		);
+	}
+	if(index) Memory_Free(index);
+	Memory_Free(list);
+	EndSnapshot(world, succ);
+	world->process = WP_NOPROC;
+	/*
+	** Выгружаем мир до сигнала, иначе ожидающий
+	** сохранения поток может успеть освободить
+	** структуру мира, пока она ещё используется.
+	*/
+	if(world->saveUnload)
+		World_Unload(world);
+	Waitable_Signal(world->wait);
+	return 0;
+}
+
+static cs_bool StartSave(World *world, cs_bool unload, cs_bool throttle) {
+	if(world->process != WP_NOPROC || !world->modified || !world->loaded)
+		return world->process == WP_SAVING;
+	world->process = WP_SAVING;
+	world->saveUnload = unload;
+	world->saveThrottle = throttle;
+	Waitable_Reset(world->wait);
+	BeginSnapshot(world);
+	Thread_Create(WorldSaveThread, world, true);
+	return true;
+}
+
+cs_bool World_Save(World *world, cs_bool unload) {
+	return StartSave(world, unload, false);
+}
+
+/*
+** Раз в секунду проверяет, каким мирам пора
+** сохраниться. Первое сохранение миров разнесено
+** по всему интервалу, чтобы они не приходились
+** на один и тот же момент.
+*/
+TIMER_FUNC(AutosaveTimer) {
+	(void)ticks; (void)left; (void)ud;
+	cs_uint64 now = Time_GetMSec();
+	cs_int32 running = 0, total = 0, pos = 0;
+
+	for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
+		World *world = Worlds_List[i];
+		if(!world) continue;
+		if(world->process == WP_SAVING) running++;
+		total++;
+	}
+
+	for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
+		World *world = Worlds_List[i];
+		if(!world) continue;
+		cs_uint64 delay = (world->saveDelay ? world->saveDelay : (cs_uint32)AutosaveDelay) * 1000ULL;
+		pos++;
+		if(delay == 0) continue;
+
+		if(world->nextSave == 0) {
+			world->nextSave = now + delay + delay * (pos - 1) / total;
+			continue;
+		}
+		if(world->nextSave > now || running >= SaveConcurrency) continue;
+		// Мир занят загрузкой или сохранением, попробуем на следующем тике
+		if(world->process != WP_NOPROC) continue;
+
+		world->nextSave = now + delay;
+		if(StartSave(world, false, true)) running++;
+	}
+}
+
+static cs_bool HasPlayers(World *world) {
+	for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+		Client *client = Clients_List[i];
+		if(client && client->playerData && client->playerData->world == world)
+			return true;
+	}
+	return false;
+}
+
+/*
+** Выгружает мир, если в нём по-прежнему никого
+** нет и к нему никто не обращался с момента
+** проверки. Несохранённый мир сначала уходит на
+** сохранение и выгрузится на одной из следующих
+** проверок.
+*/
+static cs_bool TryUnload(World *world, cs_uint64 now, cs_uint64 idle) {
+	cs_uint64 start = Time_GetMSec();
+	cs_bool unloaded = false;
+
+	Mutex_Lock(world->loadMutex);
+	if(world->loaded && world->process == WP_NOPROC &&
+	world->lastAccess + idle <= now && !HasPlayers(world)) {
+		if(world->modified)
+			StartSave(world, false, true);
+		else if(!world->exposed) {
+			// То же, что и в TrySleep: мир, к блокам которого прицепились, не трогаем
+			world->loaded = false;
+			if(Atomic_Inc(&world->pins) == 1) {
+				World_Unload(world);
+				unloaded = true;
+			} else
+				world->loaded = true;
+			Atomic_Dec(&world->pins);
+		}
+	}
+	Mutex_Unlock(world->loadMutex);
+
+	if(unloaded) {
+		Log_Info(Lang_Get(Lang_ConGrp, 11), world->name,
+			(cs_int32)(Time_GetMSec() - start), (cs_int32)(Worlds_GetResidentSize() / 1024)
+		);
+	}
+	return unloaded;
+}
+
+/*
+** Усыпляет мир, если его FastMap кэш собран для
+** текущего состояния блоков. Иначе кэш собирается
+** в фоне, и мир уснёт на одной из следующих проверок.
+*/
+static void TrySleep(World *world, cs_uint64 now) {
+	cs_bool slept = false, warm = false;
+
+	Mutex_Lock(world->loadMutex);
+	if(world->loaded && !world->dormant && world->process == WP_NOPROC &&
+	world->lastAccess + SleepDelay * 1000ULL <= now && !HasPlayers(world)) {
+		if(world->modified)
+			StartSave(world, false, true);
+		else {
+			Mutex_Lock(world->cacheMutex);
+			WorldCache *cache = world->cache[WC_FASTMAP];
+			if(cache && cache->modcount == world->modcount && !world->exposed) {
+				Atomic_Inc(&cache->refs);
+				world->dormant = cache;
+				/*
+				** Поток, прицепившийся к блокам раньше, не даст
+				** миру уснуть, а любой следующий уже увидит
+				** dormant и будет ждать мьютекс загрузки.
+				*/
+				if(Atomic_Inc(&world->pins) == 1) {
+					if(world->cache[WC_GZIP]) {
+						World_ReleaseCache(world->cache[WC_GZIP]);
+						world->cache[WC_GZIP] = NULL;
+					}
+					FreeBlocks(world);
+					slept = true;
+				} else {
+					world->dormant = NULL;
+					Atomic_Dec(&cache->refs);
+				}
+				Atomic_Dec(&world->pins);
+			} else warm = !world->exposed;
+			Mutex_Unlock(world->cacheMutex);
+		}
+	}
+	Mutex_Unlock(world->loadMutex);
+
+	if(warm) World_WarmCache(world);
+	if(slept) {
+		Log_Info(Lang_Get(Lang_ConGrp, 12), world->name,
+			(cs_int32)(Worlds_GetResidentSize() / 1024)
+		);
+	}
+}
+
+#define EVICT_GRACE 1000 // Сколько миллисекунд мир не выгружается после обращения к нему
+
+/*
+** Раз в секунду усыпляет и выгружает миры, в которых
+** давно нет игроков, а если загруженные миры не влезают
+** в MemoryLimit, то и остальные пустые миры, начиная
+** с тех, к которым дольше всего не обращались. Мир
+** по умолчанию не выгружается никогда: в него
+** попадает каждый зашедший на сервер игрок.
+*/
+TIMER_FUNC(UnloadTimer) {
+	(void)ticks; (void)left; (void)ud;
+	cs_uint64 now = Time_GetMSec();
+
+	for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
+		World *world = Worlds_List[i];
+		if(!world || !world->loaded) continue;
+		if(HasPlayers(world))
+			world->lastAccess = now;
+		else if(i > 0 && UnloadDelay > 0 && world->lastAccess + UnloadDelay * 1000ULL <= now)
+			TryUnload(world, now, UnloadDelay * 1000ULL);
+		else if(SleepDelay > 0 && !world->dormant && world->lastAccess + SleepDelay * 1000ULL <= now)
+			TrySleep(world, now);
+	}
+
+	if(MemoryLimit == 0) return;
+	cs_uint64 resident = Worlds_GetResidentSize();
+	cs_bool tried[MAX_WORLDS] = {0};
+	while(resident > MemoryLimit) {
+		World *lru = NULL;
+		for(cs_int32 i = 1; i < MAX_WORLDS; i++) {
+			World *world = Worlds_List[i];
+			if(!world || tried[i] || !world->loaded || world->process != WP_NOPROC ||
+			HasPlayers(world)) continue;
+			if(!lru || world->lastAccess < lru->lastAccess) lru = world;
+		}
+		if(!lru) break;
+		tried[lru->id] = true;
+		cs_uint32 size = World_GetResidentSize(lru);
+		// Мир, к которому обратились только что, не трогаем
+		if(TryUnload(lru, now, EVICT_GRACE)) resident -= size;
+	}
+}
+
+void Worlds_Init(void) {
+	AutosaveDelay = Config_GetInt32ByKey(Server_Config, CFG_AUTOSAVE_KEY);
+	SaveConcurrency = Config_GetInt8ByKey(Server_Config, CFG_SAVECONCURRENCY_KEY);
+	SaveRate = (cs_uint32)Config_GetInt32ByKey(Server_Config, CFG_SAVERATE_KEY) * 1024;
+	SaveStreams = Config_GetBoolByKey(Server_Config, CFG_MAPSTREAMS_KEY);
+	Sectioned = Config_GetBoolByKey(Server_Config, CFG_SECTIONS_KEY);
+	SleepDelay = (cs_uint32)Config_GetInt32ByKey(Server_Config, CFG_SLEEPDELAY_KEY);
+	UnloadDelay = (cs_uint32)Config_GetInt32ByKey(Server_Config, CFG_UNLOADDELAY_KEY);
+	MemoryLimit = (cs_uint64)Config_GetInt32ByKey(Server_Config, CFG_WORLDMEMORY_KEY) * 1048576;
+	ThrottleMutex = Mutex_Create();
+	// Не освобождается: миры ещё удаляются после Worlds_Uninit
+	WorldsMutex = Mutex_Create();
+	Timer_Add(-1, 1000, AutosaveTimer, NULL);
+	Timer_Add(-1, 1000, UnloadTimer, NULL);
+	JournalActive = true;
+	JournalSyncThread = Thread_Create(JournalThread, NULL, false);
+}
+
+void Worlds_Uninit(void) {
+	if(!JournalActive) return;
+	JournalActive = false;
+	if(Thread_IsValid(JournalSyncThread))
+		Thread_Join(JournalSyncThread);
+}
+
+// Старый формат: один gzip поток на весь массив блоков
+static cs_bool ReadLegacyBlocks(World *world, cs_file fp) {
+	cs_bool succ = false;
+	cs_int32 ret;
+	Bytef in[CHUNK_SIZE];
+	BlockID *blocks = world->wdata.blocks, *piece = NULL;
+	cs_uint32 pos = 0;
+	z_stream stream = {0};
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+
+	if((ret = inflateInit2(&stream, 31)) != Z_OK) {
+		ERROR_PRINT(ET_ZLIB, ret, false);
+		return false;
+	}
+
+	stream.next_out = blocks;
+	if(!blocks) piece = Memory_Alloc(1, CHUNK_SIZE);
+
+	do {
+		stream.avail_in = (uLongf)File_Read(in, 1, CHUNK_SIZE, fp);
+		if(File_Error(fp)) {
+			Error_PrintSys(false);
+			goto legacy_end;
+		}
 
 		if(stream.avail_in == 0) break;
 		stream.next_in = in;
 
 		do {
+			if(piece) stream.next_out = piece;
 			stream.avail_out = CHUNK_SIZE;
 			if((ret = inflate(&stream, Z_NO_FLUSH)) == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
 				ERROR_PRINT(ET_ZLIB, ret, false);
-				goto world_load_done;
+				goto legacy_end;
+			}
+			if(piece) {
+				cs_uint32 got = min(CHUNK_SIZE - stream.avail_out, world->wdata.size - pos);
+				StoreBlocks(world, pos, piece, got);
+				pos += got;
 			}
 		} while(stream.avail_out == 0);
 	} while(ret != Z_STREAM_END);
-	error = false;
+	succ = true;
 
-	world_load_done:
-	File_Close(fp);
+	legacy_end:
+	if(piece) Memory_Free(piece);
+	inflateEnd(&stream);
+	return succ;
+}
+
+/*
+** Из двух слотов индекса выбирается тот,
+** у которого сошлась контрольная сумма и
+** поколение больше, после чего все регионы
+** распаковываются в массив блоков.
+*/
+static cs_bool ReadRegions(World *world, cs_file fp) {
+	WorldRegions *reg = &world->regions;
+	cs_uint32 hdr[2];
+	if(File_Read(hdr, 8, 1, fp) != 1 || hdr[0] != WORLD_REGION_SIZE || hdr[1] != reg->count) {
+		Error_PrintF2(ET_SERVER, EC_FILECORR, false, world->name);
+		return false;
+	}
+
+	cs_bool succ = false;
+	cs_uint32 slotwords = INDEX_SLOT_SIZE(reg) / 4,
+	*slots = Memory_Alloc(2, INDEX_SLOT_SIZE(reg)),
+	*index = NULL;
+	cs_byte *in = NULL, *piece = NULL;
+	reg->indexpos = (cs_uint32)File_Tell(fp);
+	if(File_Read(slots, INDEX_SLOT_SIZE(reg), 2, fp) != 2) {
+		Error_PrintF2(ET_SERVER, EC_FILECORR, false, world->name);
+		goto regions_end;
+	}
+
+	for(cs_int32 i = 0; i < 2; i++) {
+		cs_uint32 *slot = slots + i * slotwords;
+		if(slot[0] > 0 && slot[1] == IndexCRC(slot[0], slot + 2, reg->count))
+			if(!index || slot[0] > index[-2]) index = slot + 2;
+	}
+	if(!index) {
+		Error_PrintF2(ET_SERVER, EC_FILECORR, false, world->name);
+		goto regions_end;
+	}
+
+	cs_int32 ret;
+	z_stream stream = {0};
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+
+	if((ret = inflateInit2(&stream, -15)) != Z_OK) {
+		ERROR_PRINT(ET_ZLIB, ret, false);
+		goto regions_end;
+	}
+
+	cs_uint32 incap = (cs_uint32)compressBound(WORLD_REGION_SIZE), used = 0;
+	in = Memory_Alloc(1, incap);
+	if(!world->wdata.blocks) piece = Memory_Alloc(1, WORLD_REGION_SIZE);
+	for(cs_uint32 i = 0; i < reg->count; i++) {
+		cs_uint32 offset = i * WORLD_REGION_SIZE,
+		len = index[i * 2 + 1];
+		if(len > incap || File_Seek(fp, index[i * 2], SEEK_SET) != 0 ||
+		File_Read(in, 1, len, fp) != len) {
+			Error_PrintF2(ET_SERVER, EC_FILECORR, false, world->name);
+			inflateEnd(&stream);
+			goto regions_end;
+		}
+
+		inflateReset(&stream);
+		stream.next_in = in;
+		stream.avail_in = len;
+		stream.next_out = piece ? piece : world->wdata.blocks + offset;
+		stream.avail_out = min(world->wdata.size - offset, WORLD_REGION_SIZE);
+		if((ret = inflate(&stream, Z_FINISH)) != Z_STREAM_END) {
+			ERROR_PRINT(ET_ZLIB, ret, false);
+			inflateEnd(&stream);
+			goto regions_end;
+		}
+		if(piece) StoreBlocks(world, offset, piece, min(world->wdata.size - offset, WORLD_REGION_SIZE));
+		used += len;
+	}
 	inflateEnd(&stream);
+
+	reg->index = Memory_Alloc(reg->count, 8);
+	Memory_Copy(reg->index, index, reg->count * 8);
+	reg->gen = index[-2];
+	WorldStreams *ws = &reg->streams;
+	if(ws->gen == reg->gen && ws->crc == StreamsCRC(ws)) {
+		// Потоки подходят, пока журнал не поменяет хоть один блок
+		used += StreamsSize(ws);
+		reg->streammod = world->modcount;
+	} else
+		Memory_Zero(ws, sizeof(WorldStreams));
+	reg->used = used;
+	File_Seek(fp, 0, SEEK_END);
+	reg->garbage = (cs_uint32)File_Tell(fp) - reg->indexpos - 2 * INDEX_SLOT_SIZE(reg) - used;
+	Memory_Zero(reg->dirty, reg->count);
+	reg->info = world->info;
+	succ = true;
+
+	regions_end:
+	if(piece) Memory_Free(piece);
+	if(in) Memory_Free(in);
+	Memory_Free(slots);
+	return succ;
+}
+
+THREAD_FUNC(WorldLoadThread) {
+	World *world = (World *)param;
+	cs_uint64 start = Time_GetMSec();
+	cs_bool error = true;
+	cs_uint32 magic = 0;
+	cs_char path[256];
+	String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
+
+	cs_file fp = File_Open(path, "rb");
+	if(!fp) {
+		Error_PrintSys(false);
+		goto world_load_done;
+	}
+
+	if(!ReadInfo(world, fp, &magic))
+		goto world_load_done;
+
+	World_AllocBlockArray(world);
+	if(magic == WORLD_REGMAGIC)
+		error = !ReadRegions(world, fp);
+	else {
+		error = !ReadLegacyBlocks(world, fp);
+		// Следующее сохранение перепишет мир в формате с регионами
+		world->modified = true;
+	}
+
+	if(!error) {
+		ReplayJournal(world);
+		CompactSections(world);
+		OpenJournal(world, true);
+		world->lastAccess = Time_GetMSec();
+		Log_Info(Lang_Get(Lang_ConGrp, 10), world->name,
+			(cs_int32)(world->lastAccess - start), (cs_int32)(Worlds_GetResidentSize() / 1024)
+		);
+	}
+
+	world_load_done:
+	if(fp) File_Close(fp);
 	world->process = WP_NOPROC;
 	world->saveUnload = false;
 	if(error)
 		World_Unload(world);
 	Waitable_Signal(world->wait);
+	/*
+	** Сразу после загрузки мира на сервер
+	** обычно заходят игроки, поэтому сжатую
+	** карту стоит подготовить заранее.
+	*/
+	if(!error) World_WarmCache(world);
 	return 0;
 }
 
@@ -408,15 +1975,181 @@ cs_bool World_Load(World *world) {
 	return true;
 }
 
+/*
+** Читает из файла только заголовок мира, массив
+** блоков будет загружен при первом обращении.
+*/
+cs_bool World_LoadInfo(World *world) {
+	cs_uint32 magic = 0;
+	cs_char path[256];
+	String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
+
+	cs_file fp = File_Open(path, "rb");
+	if(!fp) {
+		Error_PrintSys(false);
+		return false;
+	}
+
+	cs_bool succ = ReadInfo(world, fp, &magic);
+	File_Close(fp);
+	return succ;
+}
+
+/*
+** Запускает загрузку мира, если его массива блоков
+** ещё нет в памяти, и откладывает выгрузку мира по
+** простою. Если wait равен true, дожидается конца
+** загрузки и возвращает, удалась ли она. Плагинам
+** стоит вызывать эту функцию перед тем, как читать
+** или менять блоки мира, в котором нет игроков.
+*/
+cs_bool World_EnsureLoaded(World *world, cs_bool wait) {
+	Mutex_Lock(world->loadMutex);
+	world->lastAccess = Time_GetMSec();
+	cs_bool succ = world->loaded || World_Load(world);
+	WakeLocked(world);
+	Mutex_Unlock(world->loadMutex);
+	if(!wait) return succ;
+	if(world->process == WP_LOADING)
+		Waitable_Wait(world->wait);
+	return world->loaded;
+}
+
 void World_Unload(World *world) {
 	if(world->process != WP_NOPROC)
 		Waitable_Wait(world->wait);
+	CloseJournal(world);
+	Mutex_Lock(world->cacheMutex);
+	for(cs_int32 i = 0; i < WC_COUNT; i++) {
+		if(world->cache[i]) {
+			World_ReleaseCache(world->cache[i]);
+			world->cache[i] = NULL;
+		}
+	}
+	if(world->dormant) {
+		World_ReleaseCache(world->dormant);
+		world->dormant = NULL;
+	}
 	if(world->wdata.size) {
-		Memory_Free(world->wdata.ptr);
+		FreeBlocks(world);
 		world->wdata.size = 0;
-		world->wdata.ptr = world->wdata.blocks = NULL;
+	}
+	world->snap.chunks = 0;
+	if(world->regions.dirty) {
+		Memory_Free(world->regions.dirty);
+		world->regions.dirty = NULL;
+	}
+	if(world->regions.index) {
+		Memory_Free(world->regions.index);
+		world->regions.index = NULL;
 	}
 	world->loaded = false;
+	Mutex_Unlock(world->cacheMutex);
+}
+
+cs_uint32 World_GetResidentSize(World *world) {
+	Mutex_Lock(world->cacheMutex);
+	cs_uint32 size = BlocksSize(world);
+	for(cs_int32 i = 0; i < WC_COUNT; i++)
+		if(world->cache[i]) size += world->cache[i]->chunks * WORLD_CHUNK_PACKET;
+	Mutex_Unlock(world->cacheMutex);
+	return size;
+}
+
+cs_uint32 Worlds_GetResidentSize(void) {
+	cs_uint32 size = 0;
+	for(cs_int32 i = 0; i < MAX_WORLDS; i++)
+		if(Worlds_List[i]) size += World_GetResidentSize(Worlds_List[i]);
+	return size;
+}
+
+static WorldCache *BuildCache(World *world, cs_int32 type) {
+	if(!world->loaded) return NULL;
+
+	cs_uint32 outlen, modcount = world->modcount;
+	cs_byte *out = ParallelDeflate(world, type == WC_GZIP, &outlen);
+	if(!out) return NULL;
+
+	WorldCache *cache = Memory_Alloc(1, sizeof(WorldCache));
+	cache->modcount = modcount;
+	cache->refs = 1;
+	cache->chunks = (outlen + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE;
+	cache->data = Memory_Alloc(cache->chunks, WORLD_CHUNK_PACKET);
+
+	for(cs_uint32 i = 0; i < cache->chunks; i++) {
+		cs_byte *packet = cache->data + i * WORLD_CHUNK_PACKET;
+		cs_uint32 offset = i * WORLD_CHUNK_SIZE;
+		cs_uint16 chunklen = (cs_uint16)min(outlen - offset, WORLD_CHUNK_SIZE);
+		*packet = 0x03;
+		*(cs_uint16 *)(packet + 1) = htons(chunklen);
+		Memory_Copy(packet + 3, out + offset, chunklen);
+		packet[WORLD_CHUNK_PACKET - 1] = (cs_byte)((i + 1) * 100 / cache->chunks);
+	}
+
+	Memory_Free(out);
+	return cache;
+}
+
+WorldCache *World_GetCache(World *world, cs_int32 type) {
+	// FastMap кэш спящего мира всегда актуален, остальным нужны блоки
+	if(type != WC_FASTMAP && world->dormant) Wake(world);
+	Mutex_Lock(world->cacheMutex);
+	WorldCache *cache = world->cache[type];
+	if(!cache || cache->modcount != world->modcount) {
+		if(cache) World_ReleaseCache(cache);
+		cache = world->cache[type] = BuildCache(world, type);
+	}
+	if(cache) Atomic_Inc(&cache->refs);
+	Mutex_Unlock(world->cacheMutex);
+	return cache;
+}
+
+void World_ReleaseCache(WorldCache *cache) {
+	if(Atomic_Dec(&cache->refs) == 0) {
+		Memory_Free(cache->data);
+		Memory_Free(cache);
+	}
+}
+
+THREAD_FUNC(WorldCacheThread) {
+	World *world = (World *)param;
+	for(cs_int32 i = 0; i < WC_COUNT; i++) {
+		WorldCache *cache = World_GetCache(world, i);
+		if(cache) World_ReleaseCache(cache);
+	}
+	return 0;
+}
+
+void World_WarmCache(World *world) {
+	Thread_Create(WorldCacheThread, world, true);
+}
+
+/*
+** Открывает файл мира для отправки карты прямо с
+** диска, если в нём лежит поток нужного типа и с
+** момента его записи в мире не менялись блоки.
+*/
+cs_file World_OpenStream(World *world, cs_int32 type, cs_uint32 *offset, cs_uint32 *chunks) {
+#if defined(WINDOWS)
+	// Открытый файл не даст заменить его при полном сохранении
+	(void)world; (void)type; (void)offset; (void)chunks;
+	return NULL;
+#else
+	WorldRegions *reg = &world->regions;
+	cs_file fp = NULL;
+	Mutex_Lock(world->cacheMutex);
+	if(SaveStreams && world->loaded && reg->streams.gen > 0 && reg->streams.chunks[type] > 0 &&
+	reg->streammod == world->modcount) {
+		cs_char path[256];
+		String_FormatBuf(path, 256, "worlds" PATH_DELIM "%s", world->name);
+		if((fp = File_Open(path, "rb")) != NULL) {
+			*offset = reg->streams.offset[type];
+			*chunks = reg->streams.chunks[type];
+		}
+	}
+	Mutex_Unlock(world->cacheMutex);
+	return fp;
+#endif
 }
 
 cs_uint32 World_GetOffset(World *world, SVec *pos) {
@@ -427,18 +2160,196 @@ cs_uint32 World_GetOffset(World *world, SVec *pos) {
 	return offset;
 }
 
-cs_bool World_SetBlockO(World *world, cs_uint32 offset, BlockID id) {
-	world->wdata.blocks[offset] = id;
+static cs_bool SetBlockO(World *world, cs_uint32 offset, BlockID id) {
+	/*
+	** World_GetOffset отдаёт размер мира для позиций
+	** за его пределами, а при размере, кратном региону,
+	** такое смещение попало бы в несуществующий кусок.
+	*/
+	if(offset >= world->wdata.size) return false;
+	WorldSnapshot *snap = &world->snap;
+	cs_uint32 chunk = offset / WORLD_REGION_SIZE;
+	// Порядок относительно снапшота описан в BeginSnapshot
+	Mutex_Lock(snap->mutex);
+	TouchSnapshot(world, chunk);
+	BlockID oldid = SwapBlock(world, offset, id);
+	world->regions.dirty[chunk] = 1;
+	Mutex_Unlock(snap->mutex);
+	WriteJournal(world, offset, oldid, id);
+	world->modcount++;
 	world->modified = true;
 	return true;
 }
 
+void World_MarkModified(World *world) {
+	WorldRegions *reg = &world->regions;
+	// Какие именно блоки поменялись, неизвестно, так что сохраняем всё
+	Mutex_Lock(world->snap.mutex);
+	if(reg->dirty) Memory_Fill(reg->dirty, reg->count, 1);
+	Mutex_Unlock(world->snap.mutex);
+	world->modcount++;
+	world->modified = true;
+}
+
+cs_bool World_SetBlockO(World *world, cs_uint32 offset, BlockID id) {
+	if(!PinBlocks(world)) return false;
+	cs_bool succ = SetBlockO(world, offset, id);
+	UnpinBlocks(world);
+	return succ;
+}
+
 cs_bool World_SetBlock(World *world, SVec *pos, BlockID id) {
 	cs_uint32 offset = World_GetOffset(world, pos);
 	return World_SetBlockO(world, offset, id);
 }
 
 BlockID World_GetBlock(World *world, SVec *pos) {
-	cs_int32 offset = World_GetOffset(world, pos);
-	return world->wdata.blocks[offset];
+	if(!PinBlocks(world)) return BLOCK_AIR;
+	cs_uint32 offset = World_GetOffset(world, pos);
+	BlockID id = offset < world->wdata.size ? PeekBlock(world, offset) : BLOCK_AIR;
+	UnpinBlocks(world);
+	return id;
+}
+
+#define UPDATES_HASH_SIZE (WORLD_UPDATES_MAX * 2)
+
+void World_QueueBlockUpdate(World *world, cs_uint32 offset, BlockID id) {
+	WorldUpdates *upd = world->updates;
+	Mutex_Lock(upd->mutex);
+	if(!upd->overflow) {
+		cs_uint32 slot = (offset * 2654435761u) % UPDATES_HASH_SIZE;
+		while(upd->hash[slot] && upd->offsets[upd->hash[slot] - 1] != offset)
+			slot = (slot + 1) % UPDATES_HASH_SIZE;
+
+		if(upd->hash[slot])
+			upd->ids[upd->hash[slot] - 1] = id;
+		else if(upd->count == WORLD_UPDATES_MAX)
+			upd->overflow = true;
+		else {
+			upd->offsets[upd->count] = offset;
+			upd->ids[upd->count] = id;
+			upd->hash[slot] = (cs_uint16)++upd->count;
+		}
+	}
+	Mutex_Unlock(upd->mutex);
+}
+
+static cs_uint32 FlushOffsets[WORLD_UPDATES_MAX];
+static BlockID FlushIds[WORLD_UPDATES_MAX];
+
+static void FlushUpdates(World *world) {
+	WorldUpdates *upd = world->updates;
+	if(upd->count == 0 && !upd->overflow) return;
+
+	Mutex_Lock(upd->mutex);
+	cs_uint32 count = upd->count;
+	cs_bool overflow = upd->overflow;
+	Memory_Copy(FlushOffsets, upd->offsets, count * sizeof(cs_uint32));
+	Memory_Copy(FlushIds, upd->ids, count * sizeof(BlockID));
+	Memory_Zero(upd->hash, sizeof(upd->hash));
+	upd->count = 0;
+	upd->overflow = false;
+	Mutex_Unlock(upd->mutex);
+
+	/*
+	** Слишком много изменений за тик дешевле
+	** отправить сжатой картой целиком, чем
+	** тысячами отдельных пакетов.
+	*/
+	if(overflow) {
+		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+			Client *client = Clients_List[i];
+			if(client && Client_IsInGame(client) && Client_IsInWorld(client, world))
+				Client_ReloadWorld(client);
+		}
+		return;
+	}
+
+	cs_bool hasVanilla = false;
+	BulkBlockUpdate bbu = {0};
+	bbu.world = world;
+	for(cs_uint32 start = 0; start < count; start += 255) {
+		cs_uint32 part = min(count - start, 255);
+		Block_BulkUpdateClean(&bbu);
+		for(cs_uint32 i = 0; i < part; i++)
+			Block_BulkUpdateAdd(&bbu, FlushOffsets[start + i], FlushIds[start + i]);
+
+		PacketBuf *buf = CPE_BuildBulkBlockUpdate(&bbu);
+		for(ClientID i = 0; i < MAX_CLIENTS; i++) {
+			Client *client = Clients_List[i];
+			if(!client || !Client_IsInGame(client) || !Client_IsInWorld(client, world)) continue;
+			if(Client_GetExtVer(client, EXT_BULKUPDATE))
+				Client_SendBuf(client, buf, SEND_NORMAL);
+			else
+				hasVanilla = true;
+		}
+		PacketBuf_Release(buf);
+	}
+	if(!hasVanilla) return;
+
+	cs_uint32 dx = world->info.dimensions.x,
+	dxz = dx * world->info.dimensions.z;
+	for(cs_uint32 i = 0; i < count; i++) {
+		cs_uint32 offset = FlushOffsets[i];
+		SVec pos;
+		pos.y = (cs_int16)(offset / dxz);
+		pos.z = (cs_int16)(offset % dxz / dx);
+		pos.x = (cs_int16)(offset % dx);
+
+		PacketBuf *buf = Vanilla_BuildSetBlock(&pos, FlushIds[i]);
+		for(ClientID j = 0; j < MAX_CLIENTS; j++) {
+			Client *client = Clients_List[j];
+			if(client && Client_IsInGame(client) && Client_IsInWorld(client, world) &&
+			!Client_GetExtVer(client, EXT_BULKUPDATE))
+				Client_SendBuf(client, buf, SEND_NORMAL);
+		}
+		PacketBuf_Release(buf);
+	}
+}
+
+void Worlds_FlushUpdates(void) {
+	for(cs_int32 i = 0; i < MAX_WORLDS; i++) {
+		World *world = Worlds_List[i];
+		if(world) FlushUpdates(world);
+	}
+}
+
+void World_GridSetPos(World *world, ClientID id, cs_int32 x, cs_int32 y, cs_int32 z) {
+	WorldGrid *grid = &world->grid;
+	grid->x[id] = x;
+	grid->y[id] = y;
+	grid->z[id] = z;
+}
+
+void World_GridClear(World *world, cs_int32 cellSize) {
+	WorldGrid *grid = &world->grid;
+	SVec *dims = &world->info.dimensions;
+	cs_int32 width = max((dims->x + cellSize - 1) / cellSize, 1),
+	depth = max((dims->z + cellSize - 1) / cellSize, 1);
+
+	if(!grid->cells || grid->cellSize != cellSize ||
+	grid->width != width || grid->depth != depth) {
+		if(grid->cells) Memory_Free(grid->cells);
+		grid->cells = Memory_Alloc(width * depth, sizeof(ClientID));
+		grid->cellSize = cellSize;
+		grid->width = width;
+		grid->depth = depth;
+	}
+
+	Memory_Fill(grid->cells, (cs_size)(width * depth) * sizeof(ClientID), 0xFF);
+}
+
+cs_int32 World_GridCell(World *world, cs_int32 x, cs_int32 z) {
+	WorldGrid *grid = &world->grid;
+	cs_int32 cx = x / grid->cellSize, cz = z / grid->cellSize;
+	if(cx < 0) cx = 0; else if(cx >= grid->width) cx = grid->width - 1;
+	if(cz < 0) cz = 0; else if(cz >= grid->depth) cz = grid->depth - 1;
+	return cz * grid->width + cx;
+}
+
+void World_GridInsert(World *world, ClientID id) {
+	WorldGrid *grid = &world->grid;
+	cs_int32 cell = World_GridCell(world, grid->x[id], grid->z[id]);
+	grid->next[id] = grid->cells[cell];
+	grid->cells[cell] = id;
 }
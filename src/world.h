@@ -46,6 +46,7 @@ enum {
 	DT_WT,
 	DT_PROPS,
 	DT_COLORS,
+	DT_STREAMS,
 
 	DT_END = 0xFF
 };
@@ -76,6 +77,148 @@ typedef struct _WorldInfo {
 	cs_uint16 modprop;
 } WorldInfo;
 
+#define WORLD_CHUNK_SIZE 1024 // Размер данных в одном 0x03 пакете
+#define WORLD_CHUNK_PACKET (WORLD_CHUNK_SIZE + 4) // Полный размер 0x03 пакета
+
+enum {
+	WC_GZIP, // gzip поток с длиной массива в начале, для обычных клиентов
+	WC_FASTMAP, // Сырой deflate поток массива блоков [FastMap]
+	WC_COUNT
+};
+
+/*
+** Сжатый поток карты, заранее порезанный
+** на готовые к отправке 0x03 пакеты. Один
+** и тот же кэш отдаётся всем подключающимся
+** клиентам, пока карта не изменится.
+*/
+typedef struct _WorldCache {
+	cs_int32 volatile refs; // Количество владельцев кэша, включая сам мир
+	cs_uint32 modcount; // Значение счётчика изменений мира на момент сборки
+	cs_uint32 chunks; // Количество 0x03 пакетов в кэше
+	cs_byte *data; // Пакеты, по WORLD_CHUNK_PACKET байт каждый
+} WorldCache;
+
+/*
+** Запись DT_STREAMS в заголовке файла мира. Сжатые
+** потоки карты дописываются после регионов уже
+** нарезанными на 0x03 пакеты, ровно в том виде, в
+** котором их отдаёт WorldCache. Запись действительна
+** только вместе с индексом того же поколения.
+*/
+typedef struct _WorldStreams {
+	cs_uint32 gen; // Поколение индекса регионов, 0 - потоков в файле нет
+	cs_uint32 offset[WC_COUNT], // Смещения потоков в файле
+	chunks[WC_COUNT]; // Количество 0x03 пакетов в потоках
+	cs_uint32 crc; // Контрольная сумма предыдущих полей
+} WorldStreams;
+
+#define WORLD_SECTION_SIZE 16 // Сторона секции в блоках
+#define WORLD_SECTION_VOLUME (WORLD_SECTION_SIZE * WORLD_SECTION_SIZE * WORLD_SECTION_SIZE)
+#define WORLD_SECTION_PALETTE 16
+
+/*
+** Секция 16x16x16 блоков в секционном хранилище
+** мира. Секция из одного типа блоков хранит только
+** его, секция из нескольких типов - индексы в
+** палитре по 1, 2 или 4 бита на блок, а совсем
+** пёстрая секция - сами блоки, по байту на блок.
+*/
+typedef struct _WorldSection {
+	cs_byte bits; // Бит на блок: 0 - вся секция из palette[0], 8 - палитра не используется
+	cs_byte count; // Занятые элементы палитры
+	BlockID palette[WORLD_SECTION_PALETTE];
+	cs_byte *data;
+} WorldSection;
+
+/*
+** Массив блоков делится на регионы, каждый из
+** которых сжимается в файле мира отдельно. Это
+** же деление используется снапшотом сохранения.
+*/
+#define WORLD_REGION_SIZE 65536
+
+/*
+** Снапшот мира на время сохранения. Кусок
+** массива блоков, в который пишут во время
+** сохранения, сначала копируется, и поток
+** сохранения читает уже эту копию.
+*/
+typedef struct _WorldSnapshot {
+	Mutex *mutex;
+	cs_byte **copies; // Копии кусков, изменённых во время сохранения
+	cs_byte *dirty; // Регионы, которые нужно записать в этом сохранении
+	cs_uint32 chunks; // Количество кусков в массиве блоков
+	cs_uint32 modcount; // Значение счётчика изменений мира на начало сохранения
+	cs_bool volatile active; // Сохранение идёт прямо сейчас
+} WorldSnapshot;
+
+/*
+** Индекс регионов в файле мира. Регионы, изменённые
+** с последнего сохранения, дописываются в конец
+** файла, после чего индекс пишется в тот из двух
+** его слотов, что не был записан в прошлый раз.
+*/
+typedef struct _WorldRegions {
+	cs_uint32 count; // Количество регионов
+	cs_byte *dirty; // Регионы, изменённые с последнего сохранения
+	cs_uint32 *index; // Пары смещение/длина, NULL если в файле ещё старый формат
+	cs_uint32 indexpos; // Смещение первого слота индекса в файле
+	cs_uint32 gen; // Поколение последнего записанного индекса
+	cs_uint32 used, garbage; // Размер актуальных и устаревших регионов в файле
+	WorldInfo info; // Заголовок мира на момент последнего сохранения
+	cs_uint32 streampos; // Смещение записи DT_STREAMS в файле, 0 - записи нет
+	WorldStreams streams; // Потоки карты, лежащие в файле
+	cs_uint32 streammod; // Значение счётчика изменений мира, которому соответствуют потоки
+} WorldRegions;
+
+/*
+** Журнал изменений блоков, который дописывается
+** при каждом World_SetBlockO и сбрасывается на
+** диск пачками. После краха записи, не попавшие
+** в последнее сохранение, проигрываются заново.
+*/
+typedef struct _WorldJournal {
+	Mutex *mutex;
+	Mutex *syncMutex; // Берётся до mutex на время fsync, закрытия и сжатия журнала
+	cs_file fp; // NULL, если журнал не ведётся
+	cs_uint32 gen; // Поколение сохранения, в которое попадут новые записи
+	cs_bool dirty; // Есть записи, ещё не сброшенные на диск
+} WorldJournal;
+
+#define WORLD_UPDATES_MAX 4096 // Если за тик изменилось больше блоков, карта отправляется заново
+
+/*
+** Изменения блоков, накопленные за текущий
+** тик. Повторная запись по тому же смещению
+** заменяет предыдущую, для этого используется
+** хеш-таблица с открытой адресацией.
+*/
+typedef struct _WorldUpdates {
+	Mutex *mutex;
+	cs_uint32 count;
+	cs_bool overflow; // Изменений больше WORLD_UPDATES_MAX
+	cs_uint32 offsets[WORLD_UPDATES_MAX];
+	BlockID ids[WORLD_UPDATES_MAX];
+	cs_uint16 hash[WORLD_UPDATES_MAX * 2]; // Индекс изменения плюс один, 0 - пустая ячейка
+} WorldUpdates;
+
+/*
+** Равномерная сетка игроков мира, по которой
+** ищутся соседи в пределах радиуса обзора.
+** Позиции хранятся отдельными массивами по
+** осям, индексом в них служит id игрока.
+*/
+typedef struct _WorldGrid {
+	cs_int32 x[MAX_CLIENTS], // Позиции игроков, в блоках
+	y[MAX_CLIENTS],
+	z[MAX_CLIENTS];
+	ClientID next[MAX_CLIENTS]; // Следующий игрок в той же клетке, -1 - конец списка
+	ClientID *cells; // Первый игрок каждой клетки
+	cs_int32 cellSize, // Сторона клетки, в блоках
+	width, depth; // Количество клеток по осям X и Z
+} WorldGrid;
+
 typedef struct _World {
 	WorldID id;
 	cs_str name;
@@ -84,36 +227,105 @@ typedef struct _World {
 	Waitable *wait;
 	cs_bool loaded;
 	cs_bool saveUnload;
+	cs_bool saveThrottle; // Сохранение ограничено по скорости записи
+	cs_uint32 saveDelay; // Интервал автосохранения в секундах, 0 - из конфига
+	cs_uint64 nextSave; // Время следующего автосохранения
+	Mutex *loadMutex; // Не даёт выгрузить или усыпить мир одновременно с запросом на его загрузку
+	cs_uint64 lastAccess; // Время последнего обращения к миру, для выгрузки простаивающих
 	cs_int32 process;
+	cs_uint32 volatile modcount; // Увеличивается при каждом изменении блоков
+	Mutex *cacheMutex;
+	WorldCache *cache[WC_COUNT];
+	/*
+	** У спящего мира нет массива блоков, вместо
+	** него хранится ссылка на FastMap кэш карты,
+	** который и есть сжатый массив блоков. Мир
+	** просыпается при первом обращении к блокам.
+	*/
+	WorldCache *volatile dormant;
+	cs_int32 volatile pins; // Сколько потоков сейчас обращаются к блокам мира
+	cs_bool exposed; // Указатель на массив блоков отдан плагину, мир больше не засыпает и не выгружается
+	WorldSnapshot snap;
+	WorldRegions regions;
+	WorldJournal journal;
+	WorldUpdates *updates;
+	WorldGrid grid;
 	struct _WorldData {
 		cs_uint32 size;
 		void *ptr;
 		BlockID *blocks;
+		/*
+		** Если sectioned равен true, то вместо
+		** массива blocks мир хранится секциями,
+		** а ptr и blocks всегда равны NULL.
+		*/
+		cs_bool sectioned;
+		WorldSection *sections;
+		cs_uint32 secx, secz, // Количество секций по осям X и Z
+		seccount, // Общее количество секций
+		secbytes; // Память, занятая данными секций
+		Mutex *mutex; // Не даёт читать секцию, пока её данные перестраиваются
 	} wdata;
 } World;
 
+void Worlds_Init(void);
+void Worlds_Uninit(void);
+void Worlds_FlushUpdates(void);
 API void Worlds_SaveAll(cs_bool join, cs_bool unload);
+API cs_uint32 Worlds_GetResidentSize(void);
 
 API World *World_Create(cs_str name);
 API void World_AllocBlockArray(World *world);
+API cs_bool World_OpenJournal(World *world);
 API void World_Free(World *world);
 API cs_bool World_Add(World *world);
 API void World_UpdateClients(World *world);
 
 API cs_bool World_Load(World *world);
+API cs_bool World_LoadInfo(World *world);
+API cs_bool World_EnsureLoaded(World *world, cs_bool wait);
 API void World_Unload(World *world);
+API cs_uint32 World_GetResidentSize(World *world);
 API cs_bool World_Save(World *world, cs_bool unload);
 
 API void World_SetDimensions(World *world, const SVec *dims);
 API cs_bool World_SetBlock(World *world, SVec *pos, BlockID id);
 API cs_bool World_SetBlockO(World *world, cs_uint32 offset, BlockID id);
+API void World_QueueBlockUpdate(World *world, cs_uint32 offset, BlockID id);
+/*
+** Сообщает миру, что его блоки поменяли в обход
+** World_SetBlock, например через World_GetBlockArray.
+** Кеши карты будут собраны заново, а все регионы
+** попадут в следующее сохранение.
+*/
+API void World_MarkModified(World *world);
+
+void World_GridSetPos(World *world, ClientID id, cs_int32 x, cs_int32 y, cs_int32 z);
+void World_GridClear(World *world, cs_int32 cellSize);
+void World_GridInsert(World *world, ClientID id);
+cs_int32 World_GridCell(World *world, cs_int32 x, cs_int32 z);
 API cs_bool World_SetEnvColor(World *world, cs_byte type, Color3* color);
 API cs_bool World_SetProperty(World *world, cs_byte property, cs_int32 value);
 API cs_bool World_SetTexturePack(World *world, cs_str url);
 API cs_bool World_SetWeather(World *world, cs_int8 type);
 
+API WorldCache *World_GetCache(World *world, cs_int32 type);
+API void World_ReleaseCache(WorldCache *cache);
+API void World_WarmCache(World *world);
+API cs_file World_OpenStream(World *world, cs_int32 type, cs_uint32 *offset, cs_uint32 *chunks);
+
+/*
+** Для мира, хранящегося секциями, обе функции
+** возвращают NULL. Читать его блоки пачкой можно
+** через World_ReadBlocks, а генераторам заливать
+** их - через World_FillBlocks. Ещё не загруженный
+** мир эти функции загружают сами, дожидаясь конца
+** загрузки; если она не удалась, вернётся NULL.
+*/
 API void *World_GetData(World *world, cs_uint32 *size);
 API BlockID *World_GetBlockArray(World *world, cs_uint32 *size);
+API void World_ReadBlocks(World *world, cs_uint32 offset, BlockID *dst, cs_uint32 count);
+API void World_FillBlocks(World *world, cs_uint32 offset, cs_uint32 count, BlockID id);
 API cs_uint32 World_GetBlockArraySize(World *world);
 API cs_uint32 World_GetOffset(World *world, SVec *pos);
 API BlockID World_GetBlock(World *world, SVec *pos);